@@ -1,44 +1,182 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include "bitfield.hh"
 
 namespace gifproc::util {
 
-bitfld<uint8_t> do_read8(std::vector<uint8_t> const& source, std::size_t off, std::size_t nbits);
-bitfld<uint16_t> do_read16(std::vector<uint8_t> const& source, std::size_t off, std::size_t nbits);
-bitfld<uint32_t> do_read32(std::vector<uint8_t> const& source, std::size_t off, std::size_t nbits);
+using streampos = typename std::make_signed_t<std::size_t>;
+
+// Non-owning view of a block of memory, the owner must keep it alive for as long as the view is in use
+struct byte_span {
+   uint8_t const* _data;
+   std::size_t _size;
+
+   constexpr byte_span() : _data(nullptr), _size(0) {}
+   constexpr byte_span(uint8_t const* data, std::size_t size) : _data(data), _size(size) {}
+   byte_span(std::vector<uint8_t> const& source) : _data(source.data()), _size(source.size()) {}
+};
+
+// Non-owning view of a fixed size block of writable memory
+struct mutable_byte_span {
+   uint8_t* _data;
+   std::size_t _size;
+
+   constexpr mutable_byte_span() : _data(nullptr), _size(0) {}
+   constexpr mutable_byte_span(uint8_t* data, std::size_t size) : _data(data), _size(size) {}
+};
+
+// Cursor over a byte_span for reading whole bytes and structures out of it in order. Reads past the end fail without
+// moving the cursor.
+class byte_reader {
+private:
+   byte_span _source;
+   std::size_t _pos;
+
+public:
+   constexpr explicit byte_reader(byte_span source, std::size_t pos = 0) : _source(source), _pos(pos) {}
 
-void do_write8(std::vector<uint8_t>& sink, std::size_t off, bitfld<uint8_t> val);
-void do_write16(std::vector<uint8_t>& sink, std::size_t off, bitfld<uint16_t> val);
-void do_write32(std::vector<uint8_t>& sink, std::size_t off, bitfld<uint32_t> val);
+   template <typename T>
+   bool read(T* output) {
+      if (remaining() < sizeof(T)) {
+         return false;
+      }
+      memcpy(output, _source._data + _pos, sizeof(T));
+      _pos += sizeof(T);
+      return true;
+   }
 
-template <typename T>
-constexpr bitfld<T> do_read(std::vector<uint8_t> const& source, std::size_t off, std::size_t nbits) {
-   if constexpr (sizeof(T) == sizeof(uint8_t)) {
-      return do_read8(source, off, nbits);
-   } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
-      return do_read16(source, off, nbits);
-   } else if constexpr (sizeof(T) == sizeof(uint32_t)) {
-      return do_read32(source, off, nbits);
+   // Points output at the next nbytes of the source rather than copying them out
+   bool read_span(std::size_t nbytes, byte_span& output) {
+      if (remaining() < nbytes) {
+         return false;
+      }
+      output = byte_span(_source._data + _pos, nbytes);
+      _pos += nbytes;
+      return true;
    }
-}
 
-template <typename T>
-constexpr void do_write(std::vector<uint8_t>& sink, std::size_t off, bitfld<T> val) {
-   if constexpr (sizeof(T) == sizeof(uint8_t)) {
-      do_write8(sink, off, val);
-   } else if constexpr (sizeof(T) == sizeof(uint16_t)) {
-      do_write16(sink, off, val);
-   } else if constexpr (sizeof(T) == sizeof(uint32_t)) {
-      do_write32(sink, off, val);
+   bool skip(std::size_t nbytes) {
+      if (remaining() < nbytes) {
+         return false;
+      }
+      _pos += nbytes;
+      return true;
    }
-}
 
-using streampos = typename std::make_signed_t<std::size_t>;
+   constexpr void seek(std::size_t pos) {
+      _pos = std::min(pos, _source._size);
+   }
+
+   constexpr std::size_t tell() const {
+      return _pos;
+   }
+
+   constexpr std::size_t remaining() const {
+      return _source._size - _pos;
+   }
+
+   constexpr bool eof() const {
+      return _pos == _source._size;
+   }
+};
+
+// Buffered bit reader
+// Keeps a 64-bit window of the source, loaded a word at a time, and reads bits LSB-first out of it. The window is only
+// reloaded once a peek would run off of its end, so most reads are a shift and a mask. Near the end of the source the
+// window is assembled byte-by-byte instead, with anything past the end reading as 0.
+class bit_reader {
+private:
+   uint8_t const* _data;
+   std::size_t _nbytes;
+   std::size_t _nbits;
+
+   // Byte offset into _data which _window was loaded from
+   std::size_t _base;
+   uint64_t _window;
+   // Bit offset of the read position within _window
+   std::size_t _off;
+
+   void load_window() {
+      if (_base + sizeof(uint64_t) <= _nbytes) {
+         if (is_little_endian()) {
+            memcpy(&_window, _data + _base, sizeof(uint64_t));
+         } else {
+            assert(false);
+         }
+      } else {
+         _window = 0;
+         for (std::size_t i = _base; i < _nbytes; i++) {
+            _window |= static_cast<uint64_t>(_data[i]) << to_bit(i - _base);
+         }
+      }
+   }
+
+   void refill() {
+      _base += to_byte(_off);
+      _off &= 7;
+      load_window();
+   }
+
+public:
+   // After a refill at least this many bits are available in the window, which bounds the size of a single peek
+   constexpr static std::size_t kMaxPeekBits = bitsize_v<uint64_t> - 7;
+
+   bit_reader(uint8_t const* data, std::size_t nbytes, std::size_t nbits)
+         : _data(data), _nbytes(nbytes), _nbits(nbits), _base(0), _window(0), _off(0) {
+      load_window();
+   }
+
+   // Returns the next nbits of the source without moving the read position
+   uint32_t peek(std::size_t nbits) {
+      assert(nbits > 0 && nbits <= bitsize_v<uint32_t>);
+      if (_off + nbits > bitsize_v<uint64_t>) {
+         refill();
+      }
+      return static_cast<uint32_t>((_window >> _off) & ((uint64_t{1} << nbits) - 1));
+   }
+
+   void consume(std::size_t nbits) {
+      _off += nbits;
+   }
+
+   uint32_t read(std::size_t nbits) {
+      const uint32_t ret = peek(nbits);
+      consume(nbits);
+      return ret;
+   }
+
+   void seek(std::size_t bit_idx) {
+      _base = to_byte(bit_idx);
+      _off = bit_idx & 7;
+      load_window();
+   }
+
+   void rewind(std::size_t nbits) {
+      if (nbits <= _off) {
+         _off -= nbits;
+      } else {
+         seek(tell() - std::min(nbits, tell()));
+      }
+   }
+
+   constexpr std::size_t tell() const {
+      return to_bit(_base) + _off;
+   }
+
+   constexpr std::size_t size() const {
+      return _nbits;
+   }
+
+   constexpr bool eof() const {
+      return tell() >= _nbits;
+   }
+};
 
 // Constant-bitwidth istream
 template <std::size_t _Nbits>
@@ -47,26 +185,31 @@ class cbw_istream {
 private:
    constexpr static streampos _Nbits_sp = static_cast<streampos>(_Nbits);
 
-   std::vector<uint8_t> const& _source;
-   const std::size_t _size;
-   streampos _pos;
+   bit_reader _reader;
+
+   constexpr streampos pos() const {
+      return static_cast<streampos>(_reader.tell());
+   }
+
+   constexpr streampos size() const {
+      return static_cast<streampos>(_reader.size());
+   }
 
 public:
    using stream_integral = typename smallest_uintegral<_Nbits>::type;
    using out_type = bitfld<stream_integral>;
 
-   constexpr cbw_istream(std::vector<uint8_t> const& source, std::size_t size)
-         : _source(source), _size(size), _pos(0) {}
+   cbw_istream(byte_span source, std::size_t size)
+         : _reader(source._data, source._size, size) {}
    cbw_istream(cbw_istream&&) = delete;
 
    out_type read() {
       if (eof()) {
          return out_type();
       }
-      out_type ret = do_read<stream_integral>(_source, _pos, _Nbits);
-      _pos += _Nbits_sp;
+      out_type ret = create_nbits(static_cast<stream_integral>(_reader.read(_Nbits)), _Nbits);
       if (eof()) {
-         ret = ret.trim_mask_right(_size - (_pos - _Nbits));
+         ret = ret.trim_mask_right(size() - (pos() - _Nbits));
       }
       return ret;
    }
@@ -76,6 +219,16 @@ public:
       return result._value;
    }
 
+   // Unchecked access to the next unit, callers are expected to check eof() themselves. No trimming is done on a
+   // partial unit at the end of the stream, bits past the end of the source read as 0.
+   stream_integral peek_extract() {
+      return static_cast<stream_integral>(_reader.peek(_Nbits));
+   }
+
+   void consume(streampos num_units = 1) {
+      _reader.consume(static_cast<std::size_t>(_Nbits_sp * num_units));
+   }
+
    cbw_istream<_Nbits>& operator>>(out_type& rhs) {
       rhs = read();
       return *this;
@@ -86,55 +239,162 @@ public:
       return *this;
    }
 
-   constexpr void rewind(streampos num_rewinds) {
-      _pos = std::max(streampos{0}, _pos - _Nbits_sp * num_rewinds);
+   void rewind(streampos num_rewinds) {
+      _reader.rewind(static_cast<std::size_t>(std::min(pos(), _Nbits_sp * num_rewinds)));
    }
 
-   constexpr void seek(streampos loc) {
-      _pos = std::max(streampos{0},
-             std::min(_Nbits_sp * loc,
-                      // Round up to the next position after eof to maintain alignment
-                      ((static_cast<streampos>(_size) + _Nbits_sp - 1) / _Nbits_sp) * _Nbits_sp));
+   void seek(streampos loc) {
+      _reader.seek(static_cast<std::size_t>(
+            std::max(streampos{0},
+            std::min(_Nbits_sp * loc,
+                     // Round up to the next position after eof to maintain alignment
+                     ((size() + _Nbits_sp - 1) / _Nbits_sp) * _Nbits_sp))));
    }
 
    constexpr streampos tell_index() const {
-      return _pos / _Nbits_sp;
+      return pos() / _Nbits_sp;
    }
 
-   constexpr void seek_end() {
-      _pos = static_cast<streampos>(_size);
+   void seek_end() {
+      _reader.seek(_reader.size());
    }
 
    constexpr bool eof() const {
-      return _pos >= static_cast<streampos>(_size);
+      return _reader.eof();
    }
 };
 
-// Constant-bitwidth istream
+// Buffered bit writer
+// Accumulates bits LSB-first in a 64-bit register and stores them to the sink a 32-bit word at a time. Bytes from the
+// initial position onward are overwritten rather than OR'd into. The trailing partial word only reaches the sink on
+// flush(), which can be called any number of times and does not move the write position.
+// The sink is either a vector, which is grown as needed, or a fixed buffer. Writes which don't fit in a fixed buffer
+// are dropped and reported through overflowed().
+class bit_writer {
+private:
+   // Only set for growable sinks, in which case _buf and _capacity track its data and size
+   std::vector<uint8_t>* _vec;
+   uint8_t* _buf;
+   std::size_t _capacity;
+   bool _overflow;
+
+   // Byte offset into the sink that _acc will be stored to
+   std::size_t _base;
+   uint64_t _acc;
+   std::size_t _acc_bits;
+
+   void store(std::size_t nbytes) {
+      if (_base + nbytes > _capacity) {
+         if (_vec) {
+            _vec->resize(_base + nbytes);
+            _buf = _vec->data();
+            _capacity = _vec->size();
+         } else {
+            _overflow = true;
+            nbytes = _capacity > _base ? _capacity - _base : 0;
+         }
+      }
+      // An empty sink may not have a buffer at all
+      if (nbytes == 0) {
+         return;
+      }
+      if (is_little_endian()) {
+         memcpy(_buf + _base, &_acc, nbytes);
+      } else {
+         assert(false);
+      }
+   }
+
+   void load(std::size_t bit_idx) {
+      _base = to_byte(bit_idx);
+      _acc_bits = bit_idx & 7;
+      _acc = 0;
+      // Keep whatever is already in the sink below the write position
+      if (_acc_bits != 0 && _base < _capacity) {
+         _acc = _buf[_base] & ((uint64_t{1} << _acc_bits) - 1);
+      }
+   }
+
+public:
+   bit_writer(std::vector<uint8_t>& sink, std::size_t initial_size = 0)
+         : _vec(&sink), _buf(sink.data()), _capacity(sink.size()), _overflow(false) {
+      load(initial_size);
+   }
+
+   bit_writer(mutable_byte_span sink, std::size_t initial_size = 0)
+         : _vec(nullptr), _buf(sink._data), _capacity(sink._size), _overflow(false) {
+      load(initial_size);
+   }
+
+   // value must not have any bits set above nbits
+   void write(uint32_t value, std::size_t nbits) {
+      assert(nbits <= bitsize_v<uint32_t>);
+      _acc |= static_cast<uint64_t>(value) << _acc_bits;
+      _acc_bits += nbits;
+      if (_acc_bits >= bitsize_v<uint32_t>) {
+         store(sizeof(uint32_t));
+         _base += sizeof(uint32_t);
+         _acc >>= bitsize_v<uint32_t>;
+         _acc_bits -= bitsize_v<uint32_t>;
+      }
+   }
+
+   void flush() {
+      store(to_byte(_acc_bits + 7));
+   }
+
+   // Flushes, then moves the write position to bit_idx
+   void seek(std::size_t bit_idx) {
+      flush();
+      load(bit_idx);
+   }
+
+   // Size hint, makes room in the sink for nbits more bits past the current position. No-op for fixed buffers.
+   void reserve(std::size_t nbits) {
+      if (_vec) {
+         _vec->reserve(to_byte(tell() + nbits + 7));
+         _buf = _vec->data();
+      }
+   }
+
+   constexpr std::size_t tell() const {
+      return to_bit(_base) + _acc_bits;
+   }
+
+   constexpr bool overflowed() const {
+      return _overflow;
+   }
+};
+
+// Constant-bitwidth ostream
 template <std::size_t _Nbits>
 class cbw_ostream {
    static_assert(_Nbits > 0 && _Nbits <= bitsize_v<uint32_t>);
 private:
-   constexpr static streampos _Nbits_sp = static_cast<streampos>(_Nbits);
+   constexpr static uint32_t kValueMask = static_cast<uint32_t>((uint64_t{1} << _Nbits) - 1);
 
-   std::vector<uint8_t>& _sink;
-   streampos _cpos;
+   bit_writer _writer;
 
 public:
    using stream_integral = typename smallest_uintegral<_Nbits>::type;
    using in_type = bitfld<stream_integral>;
 
-   constexpr cbw_ostream(std::vector<uint8_t>& sink, std::size_t initial_size = 0)
-         : _sink(sink), _cpos(initial_size) {}
+   cbw_ostream(std::vector<uint8_t>& sink, std::size_t initial_size = 0)
+         : _writer(sink, initial_size) {}
+   cbw_ostream(mutable_byte_span sink, std::size_t initial_size = 0)
+         : _writer(sink, initial_size) {}
    cbw_ostream(cbw_ostream&&) = delete;
+   ~cbw_ostream() {
+      flush();
+   }
 
    void write(in_type value) {
-      do_write(_sink, static_cast<std::size_t>(_cpos), value);
-      _cpos += value.mask_len();
+      const in_type lsb_value = value.extract_to_lsb();
+      _writer.write(static_cast<uint32_t>(lsb_value._value), static_cast<std::size_t>(lsb_value.mask_len()));
    }
 
    void write(stream_integral value) {
-      write(create_nbits(value, _Nbits));
+      _writer.write(static_cast<uint32_t>(value) & kValueMask, _Nbits);
    }
 
    cbw_ostream<_Nbits>& operator<<(in_type rhs) {
@@ -147,46 +407,56 @@ public:
       return *this;
    }
 
+   // Writes out any buffered bits, see vbw_ostream::flush
+   void flush() {
+      _writer.flush();
+   }
+
    void seek_to_index(std::size_t index) {
-      const std::size_t bytes_to_i = (index / _Nbits) + 1;
-      if (_sink.size() < bytes_to_i) {
-         _sink.resize(bytes_to_i);
-      }
-      _cpos = index * _Nbits;
+      _writer.seek(index * _Nbits);
    }
 
    constexpr streampos tell_index() const {
-      return _cpos / _Nbits;
+      return static_cast<streampos>(_writer.tell() / _Nbits);
    }
 
    constexpr std::size_t size() const {
-      return static_cast<std::size_t>(_cpos);
+      return _writer.tell();
+   }
+
+   constexpr bool overflowed() const {
+      return _writer.overflowed();
    }
 };
 
 class vbw_istream {
 private:
-   std::vector<uint8_t> const& _source;
-   const std::size_t _size;
-   streampos _pos;
+   bit_reader _reader;
+
+   constexpr streampos pos() const {
+      return static_cast<streampos>(_reader.tell());
+   }
+
+   constexpr streampos size() const {
+      return static_cast<streampos>(_reader.size());
+   }
 
 public:
    using stream_integral = uint32_t;
    using out_type = bitfld<stream_integral>;
 
-   constexpr vbw_istream(std::vector<uint8_t> const& source, std::size_t size)
-         : _source(source), _size(size), _pos(0) {}
-   constexpr vbw_istream(vbw_istream&&) = delete;
+   vbw_istream(byte_span source, std::size_t size)
+         : _reader(source._data, source._size, size) {}
+   vbw_istream(vbw_istream&&) = delete;
 
    out_type read(std::size_t nbits) {
       assert(nbits <= bitsize_v<stream_integral>);
       if (eof()) {
          return out_type();
       }
-      out_type ret = do_read<stream_integral>(_source, _pos, nbits);
-      _pos += nbits;
+      out_type ret = create_nbits(_reader.read(nbits), static_cast<int>(nbits));
       if (eof()) {
-         ret = ret.trim_mask_right(_size - (_pos - nbits));
+         ret = ret.trim_mask_right(size() - (pos() - static_cast<streampos>(nbits)));
       }
       return ret;
    }
@@ -196,36 +466,55 @@ public:
       return result._value;
    }
 
-   constexpr void rewind(streampos num_bits) {
-      _pos = std::max(streampos{0}, _pos - num_bits);
+   // Unchecked access to the next nbits, see cbw_istream::peek_extract
+   stream_integral peek_extract(std::size_t nbits) {
+      return _reader.peek(nbits);
    }
 
-   constexpr void seek(streampos bit_idx) {
-      _pos = std::max(streampos{0}, std::max(static_cast<streampos>(_size), bit_idx));
+   void consume(std::size_t nbits) {
+      _reader.consume(nbits);
    }
 
-   constexpr void seek_end() {
-      _pos = static_cast<streampos>(_size);
+   void rewind(streampos num_bits) {
+      _reader.rewind(static_cast<std::size_t>(std::min(pos(), num_bits)));
+   }
+
+   void seek(streampos bit_idx) {
+      _reader.seek(static_cast<std::size_t>(std::max(streampos{0}, std::min(size(), bit_idx))));
+   }
+
+   void seek_end() {
+      _reader.seek(_reader.size());
+   }
+
+   constexpr std::size_t tell() const {
+      return _reader.tell();
    }
 
    constexpr bool eof() const {
-      return _pos >= static_cast<streampos>(_size);
+      return _reader.eof();
    }
 };
 
 class vbw_ostream {
 private:
-   std::vector<uint8_t>& _sink;
-   streampos _cpos;
+   bit_writer _writer;
 
 public:
-   constexpr vbw_ostream(std::vector<uint8_t>& sink, std::size_t initial_size = 0)
-         : _sink(sink), _cpos(static_cast<streampos>(initial_size)) {}
+   vbw_ostream(std::vector<uint8_t>& sink, std::size_t initial_size = 0)
+         : _writer(sink, initial_size) {}
+   vbw_ostream(mutable_byte_span sink, std::size_t initial_size = 0)
+         : _writer(sink, initial_size) {}
+   vbw_ostream(vbw_ostream&&) = delete;
+   ~vbw_ostream() {
+      flush();
+   }
 
    template <typename T>
    void write(bitfld<T> value) {
-      do_write(_sink, static_cast<std::size_t>(_cpos), value);
-      _cpos += value.mask_len();
+      static_assert(sizeof(T) <= sizeof(uint32_t), "vbw_ostream only supports writes of up to 32 bits");
+      const bitfld<T> lsb_value = value.extract_to_lsb();
+      _writer.write(static_cast<uint32_t>(lsb_value._value), static_cast<std::size_t>(lsb_value.mask_len()));
    }
 
    template <typename T>
@@ -234,8 +523,134 @@ public:
       return *this;
    }
 
+   // Writes out any buffered bits, the sink is only guaranteed to hold everything written after this is called
+   void flush() {
+      _writer.flush();
+   }
+
+   // Appends the first nbits bits of data written by another vbw_ostream
+   void append(byte_span data, std::size_t nbits) {
+      bit_reader reader(data._data, data._size, nbits);
+      while (nbits > 0) {
+         const std::size_t chunk_bits = std::min(nbits, bitsize_v<uint32_t>);
+         _writer.write(reader.read(chunk_bits), chunk_bits);
+         nbits -= chunk_bits;
+      }
+   }
+
+   void reserve(std::size_t nbits) {
+      _writer.reserve(nbits);
+   }
+
+   constexpr std::size_t size() const {
+      return _writer.tell();
+   }
+
+   // Set once a write didn't fit into a fixed size sink
+   constexpr bool overflowed() const {
+      return _writer.overflowed();
+   }
+};
+
+// Byte-per-unit istream, for data holding one unpacked index per byte. Reads past the end of the source return 0.
+class index_istream {
+private:
+   uint8_t const* _data;
+   std::size_t _size;
+   std::size_t _pos;
+
+public:
+   constexpr index_istream(byte_span source)
+         : _data(source._data), _size(source._size), _pos(0) {}
+   index_istream(index_istream&&) = delete;
+
+   constexpr uint8_t peek_extract() const {
+      return _pos < _size ? _data[_pos] : uint8_t{0};
+   }
+
+   constexpr void consume(std::size_t num_units = 1) {
+      _pos += num_units;
+   }
+
+   uint8_t read_extract() {
+      const uint8_t ret = peek_extract();
+      consume();
+      return ret;
+   }
+
+   index_istream& operator>>(uint8_t& rhs) {
+      rhs = read_extract();
+      return *this;
+   }
+
+   constexpr std::size_t tell_index() const {
+      return _pos;
+   }
+
+   constexpr bool eof() const {
+      return _pos >= _size;
+   }
+};
+
+// Byte-per-unit ostream, writes one index per byte into a fixed buffer. Writes past the end of the buffer are dropped
+// and reported through overflowed().
+class index_ostream {
+private:
+   uint8_t* _data;
+   std::size_t _size;
+   std::size_t _pos;
+
+public:
+   constexpr index_ostream(mutable_byte_span sink)
+         : _data(sink._data), _size(sink._size), _pos(0) {}
+   index_ostream(index_ostream&&) = delete;
+
+   void write(uint8_t value) {
+      if (_pos < _size) {
+         _data[_pos] = value;
+      }
+      _pos++;
+   }
+
+   index_ostream& operator<<(uint8_t rhs) {
+      write(rhs);
+      return *this;
+   }
+
+   // Appends a copy of len indices already written starting at offset, offset + len must not be past the current
+   // position. Indices that were dropped for not fitting are never read back, since the copy would not fit either.
+   void write_copy(std::size_t offset, std::size_t len) {
+      assert(offset + len <= _pos);
+      if (_pos < _size) {
+         memcpy(_data + _pos, _data + offset, std::min(len, _size - _pos));
+      }
+      _pos += len;
+   }
+
+   // Moves past len indices which were put into the sink by something else
+   constexpr void skip(std::size_t len) {
+      _pos += len;
+   }
+
+   // No buffering is done, this only exists to match the packed ostreams
+   constexpr void flush() {}
+
+   constexpr std::size_t tell_index() const {
+      return std::min(_pos, _size);
+   }
+
+   // Position including indices which were dropped for not fitting into the sink
+   constexpr std::size_t tell_unbounded() const {
+      return _pos;
+   }
+
+   // Size of the written data in bits, at 8 bits per index
    constexpr std::size_t size() const {
-      return static_cast<std::size_t>(_cpos);
+      return to_bit(tell_index());
+   }
+
+   constexpr bool overflowed() const {
+      return _pos > _size;
    }
 };
 
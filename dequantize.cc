@@ -1,19 +1,21 @@
 #include "dequantize.hh"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include "bitstream.hh"
 
 namespace gifproc::quant {
 
-template <std::size_t _Bits>
-void dequantize_single(dequant_params const& param, qimg const& img_meta, util::cbw_istream<_Bits>& source,
+template <typename _In>
+void dequantize_single(dequant_params const& param, qimg const& img_meta, _In& source,
                        gif_frame& img_out, std::size_t x, std::size_t y) {
 
    std::size_t pixel_off = (y * img_out._w) + x;
-   uint8_t color_index;
-   source >> color_index;
+   const uint8_t color_index = source.peek_extract();
+   source.consume();
 
    // If the pixel is transparent, let prepare_frame assign the color
    if (!img_meta._t_index || color_index != img_meta._t_index) {
@@ -24,9 +26,9 @@ void dequantize_single(dequant_params const& param, qimg const& img_meta, util::
    }
 }
 
-template <std::size_t _Bits>
-void dequantize_image(dequant_params const& param, qimg const& source, gif_frame& img_out) {
-   util::cbw_istream<_Bits> stream(source._index, source._nbits);
+// _In is any index stream with peek_extract/consume, either bit-packed or one index per byte
+template <typename _In>
+void dequantize_image(dequant_params const& param, qimg const& source, _In& stream, gif_frame& img_out) {
    if (param._interlaced) {
       for (std::size_t i = img_out._region_y; i < img_out._region_y + img_out._region_h; i += 8) {
          for (std::size_t j = img_out._region_x; j < img_out._region_x + img_out._region_w; j++) {
@@ -78,39 +80,116 @@ void prepare_frame(gif_frame& dq_out, dequant_params const& param, gif_frame con
 void dequantize_from(gif_frame& dq_out, dequant_params const& param, qimg const& source) {
    switch (source._bpp) {
       case 1: {
-         dequantize_image<1>(param, source, dq_out);
+         util::cbw_istream<1> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 2: {
-         dequantize_image<2>(param, source, dq_out);
+         util::cbw_istream<2> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 3: {
-         dequantize_image<3>(param, source, dq_out);
+         util::cbw_istream<3> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 4: {
-         dequantize_image<4>(param, source, dq_out);
+         util::cbw_istream<4> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 5: {
-         dequantize_image<5>(param, source, dq_out);
+         util::cbw_istream<5> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 6: {
-         dequantize_image<6>(param, source, dq_out);
+         util::cbw_istream<6> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 7: {
-         dequantize_image<7>(param, source, dq_out);
+         util::cbw_istream<7> stream(source._index, source._nbits);
+         dequantize_image(param, source, stream, dq_out);
          return;
       }
       case 8: {
-         dequantize_image<8>(param, source, dq_out);
-         return;         
+         // 8 bit indices are stored one per byte, so there's nothing to unpack
+         util::index_istream stream(util::byte_span(source._index.data(), util::to_byte(source._nbits)));
+         dequantize_image(param, source, stream, dq_out);
+         return;
       }
       default:
          assert(false);
    }
 }
+
+canvas_ostream::canvas_ostream(gif_frame& canvas, dequant_params const& param, color_table_view palette,
+                               std::optional<uint8_t> t_index,
+                               util::mutable_byte_span scratch)
+      : _indices(scratch), _index_data(scratch._data), _painted(0), _canvas(canvas),
+        _region_w(canvas._region_w),
+        _visible_w(canvas._region_x < canvas._w ? std::min<std::size_t>(canvas._region_w,
+                                                                          canvas._w - canvas._region_x) : 0) {
+   assert(scratch._size >= static_cast<std::size_t>(canvas._region_w) * canvas._region_h);
+
+   // Indices outside of the palette are drawn black, rather than read past the end of it
+   _lut.fill(pixel(0, 0, 0, 255));
+   for (std::size_t i = 0; i < std::min<std::size_t>(palette.size(), _lut.size()); i++) {
+      _lut[i] = pixel(palette[i]._red, palette[i]._green, palette[i]._blue, 255);
+   }
+   if (t_index) {
+      _lut[*t_index] = pixel();
+   }
+
+   const auto add_rows = [this] (std::size_t first, std::size_t step) {
+      for (std::size_t i = first; i < _canvas._region_h; i += step) {
+         const std::size_t y = _canvas._region_y + i;
+         _row_offsets.push_back(y < _canvas._h ? (y * _canvas._w) + _canvas._region_x : kClippedRow);
+      }
+   };
+   _row_offsets.reserve(_canvas._region_h);
+   if (param._interlaced) {
+      add_rows(0, 8);
+      add_rows(4, 8);
+      add_rows(2, 4);
+      add_rows(1, 2);
+   } else {
+      add_rows(0, 1);
+   }
+}
+
+void canvas_ostream::paint(std::size_t end) {
+   if (_region_w == 0) {
+      return;
+   }
+   while (_painted < end) {
+      const std::size_t row = _painted / _region_w;
+      const std::size_t col = _painted % _region_w;
+      const std::size_t run = std::min(end - _painted, _region_w - col);
+      if (_row_offsets[row] != kClippedRow && col < _visible_w) {
+         const std::size_t visible = std::min(run, _visible_w - col);
+         uint8_t const* src = _index_data + _painted;
+         pixel* dst = _canvas._img.data() + _row_offsets[row] + col;
+         for (std::size_t i = 0; i < visible; i++) {
+            pixel const& color = _lut[src[i]];
+            if (color._a != 0) {
+               dst[i] = color;
+            }
+         }
+      }
+      _painted += run;
+   }
+}
+
+void canvas_ostream::finish() {
+   const std::size_t region_size = _region_w * _canvas._region_h;
+   const std::size_t written = _indices.tell_index();
+   if (written < region_size) {
+      memset(_index_data + written, 0, region_size - written);
+   }
+   paint(region_size);
+}
+
 }
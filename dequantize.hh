@@ -1,9 +1,11 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <optional>
 #include <vector>
 
+#include "bitstream.hh"
 #include "gif_spec.hh"
 #include "quant_base.hh"
 
@@ -21,4 +23,84 @@ struct dequant_params {
 void prepare_frame(gif_frame& dq_out, dequant_params const& param, gif_frame const& previous);
 void dequantize_from(gif_frame& dq_out, dequant_params const& param, qimg const& source);
 
+// canvas_ostream dequantizes indices into the active region of a frame as they are decoded, in place of building a
+// qimg and running dequantize_from over it. The indices are still kept one per byte in the scratch span, since the LZW
+// decoder copies earlier output, but each finished run goes through a palette lookup table straight into the canvas
+// rows (remapped if interlaced). Transparent indices leave the canvas alone, the same as dequantize_from.
+// Matches the index_ostream interface used by the LZW decompressors.
+class canvas_ostream {
+private:
+   constexpr static std::size_t kClippedRow = static_cast<std::size_t>(-1);
+
+   util::index_ostream _indices;
+   uint8_t* _index_data;
+   std::size_t _painted;
+
+   gif_frame& _canvas;
+   std::size_t _region_w;
+   // Columns of the region that fall within the canvas
+   std::size_t _visible_w;
+   // Canvas offset of each row of the region in decode order, or kClippedRow if it is off the canvas
+   std::vector<std::size_t> _row_offsets;
+   // Alpha of 0 marks the transparent index
+   std::array<pixel, 256> _lut;
+
+   void paint(std::size_t end);
+
+   // Paints once at least a row is pending, so the indices are still in cache when read back
+   void paint_pending() {
+      if (_indices.tell_index() - _painted >= _region_w) {
+         paint(_indices.tell_index());
+      }
+   }
+
+public:
+   // scratch must hold an index for every pixel in the region
+   canvas_ostream(gif_frame& canvas, dequant_params const& param, color_table_view palette,
+                  std::optional<uint8_t> t_index, util::mutable_byte_span scratch);
+   canvas_ostream(canvas_ostream&&) = delete;
+
+   canvas_ostream& operator<<(uint8_t rhs) {
+      _indices << rhs;
+      paint_pending();
+      return *this;
+   }
+
+   void write_copy(std::size_t offset, std::size_t len) {
+      _indices.write_copy(offset, len);
+      paint_pending();
+   }
+
+   void flush() {
+      paint(_indices.tell_index());
+   }
+
+   // Counts the next nindices in the scratch span as written, for when they were decoded into it directly, as
+   // lzw_decompress_indices_parallel does
+   void skip_decoded(std::size_t nindices) {
+      _indices.skip(nindices);
+      paint_pending();
+   }
+
+   // Paints everything written so far, then fills in any pixels the data ran short of with index 0, which is what
+   // dequantize_from does for a short qimg
+   void finish();
+
+   constexpr std::size_t tell_index() const {
+      return _indices.tell_index();
+   }
+
+   constexpr std::size_t tell_unbounded() const {
+      return _indices.tell_unbounded();
+   }
+
+   constexpr std::size_t size() const {
+      return _indices.size();
+   }
+
+   constexpr bool overflowed() const {
+      return _indices.overflowed();
+   }
+};
+
 }
@@ -1,16 +1,20 @@
 #include "gif_processor.hh"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cassert>
 #include <cstring>
-#include <functional>
 #include <iterator>
+#include <mutex>
 #include <optional>
 
 #include "bitstream.hh"
 #include "dequantize.hh"
 #include "lzw.hh"
 #include "quantize.hh"
+#include "subblock.hh"
 
 namespace gifproc {
 namespace {
@@ -28,6 +32,16 @@ constexpr std::string_view kNetscapeAuth = "2.0";
 static_assert(std::distance(kNetscapeAuth.begin(), kNetscapeAuth.end()) ==
               sizeof(application_extension::_authentication_code));
 
+// Frames smaller than this are LZW coded on one thread even when there is a thread pool
+constexpr std::size_t kMinParallelPixels = std::size_t{1} << 20;
+
+// Frames decoded ahead of the compositor by default when there is a thread pool
+constexpr std::size_t kDefaultDecodeLookahead = 8;
+
+// Seeking keeps the canvas before every 16th frame, in up to 64MB
+constexpr std::size_t kDefaultSeekInterval = 16;
+constexpr std::size_t kDefaultSeekBudget = std::size_t{64} << 20;
+
 struct color_table_info {
    constexpr color_table_info(std::vector<color_table_entry> const& table, uint8_t tp_idx)
          : _table(table), _tp_idx(tp_idx), _tp_present(true) {}
@@ -38,9 +52,11 @@ struct color_table_info {
    bool _tp_present;
 };
 
-std::optional<gif_version> parse_gif_version(std::ifstream& in) {
+std::optional<gif_version> parse_gif_version(util::byte_reader& in) {
    gif_header header;
-   in.read(header._version, sizeof(gif_header::_version));
+   if (!in.read(&header)) {
+      return std::nullopt;
+   }
    if (std::equal(kGif87Magic.begin(), kGif87Magic.end(), header._version)) {
       return gif_version::kGif87a;
    } else if (std::equal(kGif89Magic.begin(), kGif89Magic.end(), header._version)) {
@@ -50,195 +66,184 @@ std::optional<gif_version> parse_gif_version(std::ifstream& in) {
 }
 
 template <typename T>
-std::optional<T> stream_read(std::ifstream& in) {
+std::optional<T> stream_read(util::byte_reader& in) {
    T val;
-   in.read(reinterpret_cast<char*>(&val), sizeof(T));
-   return in.gcount() == sizeof(T) ? std::make_optional(val) : std::nullopt;
+   return in.read(&val) ? std::make_optional(val) : std::nullopt;
 }
 
 template <typename T>
-bool stream_read(std::ifstream& in, T* output) {
-   in.read(reinterpret_cast<char*>(output), sizeof(T));
-   return in.gcount() == sizeof(T);
+bool stream_read(util::byte_reader& in, T* output) {
+   return in.read(output);
 }
 
-template <typename _It>
-bool stream_read_container(std::ifstream& in, _It begin, _It end) {
-   using T = typename std::iterator_traits<_It>::value_type;
-   for (_It i = begin; i != end; i++) {
-      in.read(reinterpret_cast<char*>(&(*i)), sizeof(T));
-      if (in.gcount() != sizeof(T)) {
-         return false;
-      }
-   }
-   return true;
+// Size in the file of a color table with table bits as stored in the descriptors
+constexpr std::size_t color_table_size(uint8_t table_bits) {
+   return sizeof(color_table_entry) << (table_bits + 1);
 }
 
-bool read_color_table(std::ifstream& in, uint8_t table_bits, std::vector<color_table_entry>& table_out) {
+bool read_color_table(util::byte_reader& in, uint8_t table_bits, std::vector<color_table_entry>& table_out) {
    // Invalid files will not cause this, so assert to be safe
    assert(table_bits < 8);
+   util::byte_span table_data;
+   if (!in.read_span(color_table_size(table_bits), table_data)) {
+      return false;
+   }
    table_out.resize(1 << (table_bits + 1));
-   return stream_read_container(in, table_out.begin(), table_out.end());
+   memcpy(table_out.data(), table_data._data, table_data._size);
+   return true;
 }
 
-gif_parse_result for_each_subblock(std::ifstream& in,
-                                   std::optional<std::function<gif_parse_result(uint8_t*, uint16_t)>>&& func) {
-   uint16_t subblock_len;
-   std::array<uint8_t, 255> subblock;
+// Calls func(data, len) on the payload of each data sub-block up to and past the block terminator, stopping at the
+// first result other than kSuccess. Inlined into each caller rather than going through a std::function.
+template <typename F>
+gif_parse_result for_each_subblock(util::byte_reader& in, F&& func) {
+   uint8_t subblock_len;
+   util::byte_span subblock;
    for (;;) {
-      subblock_len = static_cast<uint16_t>(in.get());
-      if (in.gcount() != 1) {
+      if (!in.read(&subblock_len)) {
          return gif_parse_result::kUnexpectedEof;
       }
       if (subblock_len == 0) {
          break;
       }
 
-      if (func) {
-         if (!stream_read_container(in, subblock.begin(), subblock.begin() + subblock_len)) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         gif_parse_result cb_result = (*func)(subblock.data(), subblock_len);
-         if (cb_result != gif_parse_result::kSuccess) {
-            return cb_result;
-         }
-      } else {
-         in.ignore(subblock_len);
-         if (in.gcount() != subblock_len) {
-            return gif_parse_result::kUnexpectedEof;
-         }
+      if (!in.read_span(subblock_len, subblock)) {
+         return gif_parse_result::kUnexpectedEof;
+      }
+      gif_parse_result cb_result = func(subblock._data, subblock_len);
+      if (cb_result != gif_parse_result::kSuccess) {
+         return cb_result;
       }
    }
    return gif_parse_result::kSuccess;
 }
-}
-
-gif::gif() : _dctx(nullptr), _ctx_debug(nullptr), _active_gce(std::nullopt) {}
 
-gif::gif(gif&& rhs)
-      : _dctx(std::move(rhs._dctx)),
-        _ctx_debug(rhs._ctx_debug),
-        _active_gce(std::nullopt),
-        _raw_ifile(std::move(rhs._raw_ifile)) {}
+gif_parse_result skip_subblocks(util::byte_reader& in) {
+   return for_each_subblock(in, [] (uint8_t const*, uint16_t) { return gif_parse_result::kSuccess; });
+}
 
-gif_parse_result gif::open_read(std::string_view path) {
-   _raw_ifile.open(path.data(), std::ios::binary);
-   return parse_contents();
+// The following read an extension of each kind after its label
+gif_parse_result parse_graphics_control_extension(util::byte_reader& in, graphics_control_extension& gce_out) {
+   auto block_size = stream_read<uint8_t>(in);
+   if (!block_size) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (block_size != kGraphicsExtensionSize) {
+      return gif_parse_result::kInvalidBlockSize;
+   }
+   if (!stream_read(in, &gce_out)) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   auto block_term = stream_read<uint8_t>(in);
+   if (!block_term) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (block_term != 0) {
+      return gif_parse_result::kInvalidBlockSize;
+   }
+   return gif_parse_result::kSuccess;
 }
 
-gif_parse_result gif::open_read(std::ifstream&& stream) {
-   _raw_ifile = std::move(stream);
-   return parse_contents();
+gif_parse_result skip_plaintext_extension(util::byte_reader& in) {
+   auto block_size = stream_read<uint8_t>(in);
+   if (!block_size) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (block_size != kPlaintextExtensionSize) {
+      return gif_parse_result::kInvalidBlockSize;
+   }
+   if (!in.skip(sizeof(plaintext_extension))) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   return skip_subblocks(in);
 }
 
-gif_parse_result gif::parse_application_extension() {
+// Reads the body of an application extension, which is only kept if it is the netscape looping extension
+gif_parse_result parse_application_body(util::byte_reader& in, std::optional<netscape_extension>& nse_out) {
    application_extension extension;
-   if (!stream_read(_raw_ifile, &extension)) {
+   if (!stream_read(in, &extension)) {
       return gif_parse_result::kUnexpectedEof;
    }
 
    if (!std::equal(kNetscapeId.begin(), kNetscapeId.end(), extension._application_identifier) ||
        !std::equal(kNetscapeAuth.begin(), kNetscapeAuth.end(), extension._authentication_code)) {
-      return for_each_subblock(_raw_ifile, std::nullopt);
+      return skip_subblocks(in);
    }
 
    // Processing as subblocks to allow skipping unsupported application ext. types for netscape
-   auto first_block_len = stream_read<uint8_t>(_raw_ifile);
+   auto first_block_len = stream_read<uint8_t>(in);
    if (!first_block_len) {
       return gif_parse_result::kUnexpectedEof;
    }
    if (first_block_len != 3) {
-      _raw_ifile.seekg(-1, std::ios::cur);
-      return for_each_subblock(_raw_ifile, std::nullopt);
+      in.seek(in.tell() - 1);
+      return skip_subblocks(in);
    }
 
-   auto netscape_app_type = stream_read<uint8_t>(_raw_ifile);
+   auto netscape_app_type = stream_read<uint8_t>(in);
    if (!netscape_app_type) {
       return gif_parse_result::kUnexpectedEof;
    }
    if (netscape_app_type != 0x01) {
-      _raw_ifile.ignore(2);
-      return gif_parse_result::kSuccess;
+      return in.skip(2) ? gif_parse_result::kSuccess : gif_parse_result::kUnexpectedEof;
    }
 
-   auto loop_count = stream_read<uint16_t>(_raw_ifile);
+   auto loop_count = stream_read<uint16_t>(in);
    if (!loop_count) {
       return gif_parse_result::kUnexpectedEof;
    }
-   _dctx->_nse = netscape_extension { *loop_count };
+   nse_out = netscape_extension { *loop_count };
+   return gif_parse_result::kSuccess;
+}
+
+gif_parse_result parse_application_extension(util::byte_reader& in, std::optional<netscape_extension>& nse_out) {
+   auto block_size = stream_read<uint8_t>(in);
+   if (!block_size) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (block_size != kApplicationExtensionSize) {
+      return gif_parse_result::kInvalidBlockSize;
+   }
+   gif_parse_result extension_parse = parse_application_body(in, nse_out);
+   if (extension_parse != gif_parse_result::kSuccess) {
+      return extension_parse;
+   }
+   auto block_term = stream_read<uint8_t>(in);
+   if (!block_term) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (block_term != 0) {
+      return gif_parse_result::kInvalidBlockSize;
+   }
    return gif_parse_result::kSuccess;
 }
 
-gif_parse_result gif::parse_extension() {
-   auto extension_label = stream_read<uint8_t>(_raw_ifile);
+// An extension after its introducer, see read_block
+template <typename _Visitor>
+gif_parse_result read_extension(util::byte_reader& in, std::optional<graphics_control_extension>& active_gce,
+                                std::optional<netscape_extension>& nse, _Visitor& visitor) {
+   auto extension_label = stream_read<uint8_t>(in);
    if (!extension_label) {
       return gif_parse_result::kUnexpectedEof;
    }
 
    switch (*extension_label) {
       case kGraphicsExtensionLabel: {
-         auto block_size = stream_read<uint8_t>(_raw_ifile);
-         if (!block_size) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         if (block_size != kGraphicsExtensionSize) {
-            return gif_parse_result::kInvalidBlockSize;
-         }
-         _active_gce = graphics_control_extension {};
-         if (!stream_read(_raw_ifile, &_active_gce.value())) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         auto block_term = stream_read<uint8_t>(_raw_ifile);
-         if (!block_term) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         if (block_term != 0) {
-            return gif_parse_result::kInvalidBlockSize;
-         }
-         return gif_parse_result::kSuccess;
+         active_gce = graphics_control_extension {};
+         return parse_graphics_control_extension(in, *active_gce);
       }
 
       case kPlaintextExtensionLabel: {
          // Ignore this extension
-         auto block_size = stream_read<uint8_t>(_raw_ifile);
-         if (!block_size) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         if (block_size != kPlaintextExtensionSize) {
-            return gif_parse_result::kInvalidBlockSize;
-         }
-         _raw_ifile.ignore(sizeof(plaintext_extension));
-         return for_each_subblock(_raw_ifile, std::nullopt);
+         return skip_plaintext_extension(in);
       }
 
       case kApplicationExtensionLabel: {
-         auto block_size = stream_read<uint8_t>(_raw_ifile);
-         if (!block_size) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         if (block_size != kApplicationExtensionSize) {
-            return gif_parse_result::kInvalidBlockSize;
-         }
-         gif_parse_result extension_parse = parse_application_extension();
-         if (extension_parse != gif_parse_result::kSuccess) {
-            return extension_parse;
-         }
-         auto block_term = stream_read<uint8_t>(_raw_ifile);
-         if (!block_term) {
-            return gif_parse_result::kUnexpectedEof;
-         }
-         if (block_term != 0) {
-            return gif_parse_result::kInvalidBlockSize;
-         }
-         return gif_parse_result::kSuccess;
+         return parse_application_extension(in, nse);
       }
 
       case kCommentExtensionLabel: {
-         std::string& comment_out = _dctx->_comments.emplace_back();
-         return for_each_subblock(_raw_ifile, [&comment_out] (uint8_t* data, uint16_t len) {
-               comment_out.append(reinterpret_cast<char*>(data), len);
-               return gif_parse_result::kSuccess;
-            });
+         return visitor.comment(in);
       }
 
       default: {
@@ -247,102 +252,440 @@ gif_parse_result gif::parse_extension() {
    }
 }
 
-gif_parse_result gif::parse_image_data(std::size_t frame_number) {
-   gif_frame_context& new_frame = _dctx->_frames.emplace_back();
-   new_frame._frame_number = frame_number;
+// The blocks after the logical screen, shared by gif::parse_block and probe. Reads one block, keeping a graphics
+// control extension in active_gce for the block right after it only. _Visitor handles what the two treat differently:
+//    gif_parse_result comment(util::byte_reader& in) reads the sub-blocks of a comment extension
+//    gif_parse_result image(util::byte_reader& in, std::optional<graphics_control_extension> const& gce) reads an image
+//    from its descriptor on
+template <typename _Visitor>
+gif_parse_result read_block(util::byte_reader& in, gif_version version,
+                            std::optional<graphics_control_extension>& active_gce,
+                            std::optional<netscape_extension>& nse, bool& trailer_found, _Visitor&& visitor) {
+   auto next_block = stream_read<uint8_t>(in);
+   if (!next_block) {
+      return gif_parse_result::kUnexpectedEof;
+   }
 
-   if (_active_gce) {
-      new_frame._extension = std::move(_active_gce);
+   bool destroy_active_gce = active_gce.has_value();
+
+   gif_parse_result block_parse_result = gif_parse_result::kSuccess;
+   switch (*next_block) {
+      case kExtensionIntroducer:
+         if (version != gif_version::kGif89a) {
+            return gif_parse_result::kNotSupported;
+         }
+         block_parse_result = read_extension(in, active_gce, nse, visitor);
+         break;
+      case kImageSeparator:
+         block_parse_result = visitor.image(in, active_gce);
+         break;
+      case kGifTrailer:
+         trailer_found = true;
+         break;
    }
 
-   if (!stream_read(_raw_ifile, &new_frame._descriptor)) {
-      return gif_parse_result::kUnexpectedEof;
+   if (block_parse_result != gif_parse_result::kSuccess) {
+      return block_parse_result;
    }
 
-   if (new_frame._descriptor._lct_present &&
-       !read_color_table(_raw_ifile, new_frame._descriptor._lct_size, new_frame._local_color_table)) {
-      return gif_parse_result::kUnexpectedEof;
+   if (destroy_active_gce) {
+      active_gce = std::nullopt;
    }
+   return gif_parse_result::kSuccess;
+}
 
-   if (!stream_read(_raw_ifile, &new_frame._min_code_size)) {
-      return gif_parse_result::kUnexpectedEof;
+// Counts up the frames for probe, skipping over everything else
+struct summary_visitor {
+   gif_summary& _summary;
+
+   gif_parse_result comment(util::byte_reader& in) {
+      return skip_subblocks(in);
+   }
+
+   gif_parse_result image(util::byte_reader& in, std::optional<graphics_control_extension> const& gce) {
+      image_descriptor descriptor;
+      if (!stream_read(in, &descriptor)) {
+         return gif_parse_result::kUnexpectedEof;
+      }
+      // The local color table and the LZW minimum code size
+      const std::size_t lct_size = descriptor._lct_present ? color_table_size(descriptor._lct_size) : 0;
+      if (!in.skip(lct_size + 1)) {
+         return gif_parse_result::kUnexpectedEof;
+      }
+      gif_parse_result skip_result = skip_subblocks(in);
+      gif_frame_summary& frame = _summary._frames.emplace_back();
+      frame._delay_time = gce ? gce->_delay_time : 0;
+      frame._disposal_method = gce ? gce->_disposal_method : gif_disposal_method::kNone;
+      _summary._total_duration += frame._delay_time;
+      return skip_result;
    }
+};
 
-   new_frame._image_data_start = _raw_ifile.tellg();
-   // Skip image data to be loaded later
-   return for_each_subblock(_raw_ifile, std::nullopt);
+lzw::lzw_decoder& thread_decoder() {
+   thread_local lzw::lzw_decoder decoder;
+   return decoder;
 }
 
-gif_parse_result gif::parse_contents() {
-   if (!_raw_ifile.is_open()) {
+// Table bits for a color table holding nentries, as stored in the descriptors: the table has 2 << bits entries
+uint8_t color_table_bits(std::size_t nentries) {
+   uint8_t bits = 0;
+   while ((std::size_t{2} << bits) < nentries) {
+      bits++;
+   }
+   return bits;
+}
+
+template <typename T>
+void buffer_write(std::vector<uint8_t>& out, T const& val) {
+   uint8_t const* bytes = reinterpret_cast<uint8_t const*>(&val);
+   out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// Writes the first 2 << table_bits entries of table, padding it with black
+void write_color_table(std::ostream& out, std::vector<color_table_entry> const& table, uint8_t table_bits) {
+   const std::size_t nentries = std::size_t{2} << table_bits;
+   const std::size_t ncopied = std::min(nentries, table.size());
+   out.write(reinterpret_cast<const char*>(table.data()), ncopied * sizeof(color_table_entry));
+   std::fill_n(std::ostream_iterator<char>(out), (nentries - ncopied) * sizeof(color_table_entry), 0);
+}
+}
+
+gif::gif()
+      : _dctx(nullptr),
+        _ctx_debug(nullptr),
+        _active_gce(std::nullopt),
+        _pool(nullptr),
+        _clear_policy(lzw::clear_policy::kClearAtFull),
+        _lossy_distance(0),
+        _decode_lookahead(kDefaultDecodeLookahead),
+        _seek_interval(kDefaultSeekInterval),
+        _seek_budget(kDefaultSeekBudget) {}
+
+gif::gif(gif&& rhs)
+      : _dctx(std::move(rhs._dctx)),
+        _ctx_debug(rhs._ctx_debug),
+        _active_gce(std::nullopt),
+        _push(std::move(rhs._push)),
+        _seek(std::move(rhs._seek)),
+        _mapped_ifile(std::move(rhs._mapped_ifile)),
+        _owned_ifile(std::move(rhs._owned_ifile)),
+        _input(std::exchange(rhs._input, util::byte_span())),
+        _pool(rhs._pool),
+        _clear_policy(rhs._clear_policy),
+        _lossy_distance(rhs._lossy_distance),
+        _lossy_gct(std::move(rhs._lossy_gct)),
+        _decode_lookahead(rhs._decode_lookahead),
+        _seek_interval(rhs._seek_interval),
+        _seek_budget(rhs._seek_budget) {}
+
+gif_parse_result gif::open_read(std::string_view path) {
+   _push = nullptr;
+   _seek = nullptr;
+   _owned_ifile = std::vector<uint8_t>();
+   if (!_mapped_ifile.open(path)) {
+      _input = util::byte_span();
       return gif_parse_result::kFileNotFound;
    }
+   _input = _mapped_ifile.data();
+   return parse_contents();
+}
 
+gif_parse_result gif::open_read(std::ifstream&& stream) {
+   _push = nullptr;
+   _seek = nullptr;
+   _mapped_ifile.close();
+   _owned_ifile.clear();
+   if (!stream.is_open()) {
+      _input = util::byte_span();
+      return gif_parse_result::kFileNotFound;
+   }
+   // Sized up front when the stream can tell how much is left, so the data is copied once
+   const std::streampos start = stream.tellg();
+   if (start != std::streampos(-1) && stream.seekg(0, std::ios::end)) {
+      const std::streampos end = stream.tellg();
+      stream.seekg(start);
+      _owned_ifile.resize(static_cast<std::size_t>(end - start));
+      stream.read(reinterpret_cast<char*>(_owned_ifile.data()), static_cast<std::streamsize>(_owned_ifile.size()));
+      _owned_ifile.resize(static_cast<std::size_t>(stream.gcount()));
+   } else {
+      stream.clear();
+      _owned_ifile.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+   }
+   _input = util::byte_span(_owned_ifile);
+   return parse_contents();
+}
+
+gif_parse_result gif::open_read(util::byte_span data) {
+   _push = nullptr;
+   _seek = nullptr;
+   _mapped_ifile.close();
+   _owned_ifile = std::vector<uint8_t>();
+   _input = data;
+   return parse_contents();
+}
+
+void gif::begin_push_read(gif_push_callbacks callbacks) {
+   _mapped_ifile.close();
+   _owned_ifile.clear();
+   _input = util::byte_span();
    _dctx = std::make_unique<deserialized_gif_context>();
    _ctx_debug = _dctx.get();
-   auto version_opt = parse_gif_version(_raw_ifile);
+   _active_gce = std::nullopt;
+   _seek = nullptr;
+   _push = std::make_unique<push_context>();
+   _push->_callbacks = std::move(callbacks);
+   _push->_parsed = 0;
+   _push->_screen_parsed = false;
+}
+
+gif_parse_result gif::push_read(util::byte_span chunk) {
+   assert(_push);
+   if (_push->_result) {
+      return *_push->_result;
+   }
+   _owned_ifile.insert(_owned_ifile.end(), chunk._data, chunk._data + chunk._size);
+   _input = util::byte_span(_owned_ifile);
+   util::byte_reader in(_input, _push->_parsed);
+
+   if (!_push->_screen_parsed) {
+      // Too little data for the header would otherwise read as an invalid one
+      if (in.remaining() < sizeof(gif_header)) {
+         return gif_parse_result::kNeedMoreData;
+      }
+      gif_parse_result screen_result = parse_screen(in);
+      if (screen_result == gif_parse_result::kUnexpectedEof) {
+         return gif_parse_result::kNeedMoreData;
+      }
+      if (screen_result != gif_parse_result::kSuccess) {
+         return finish_push(screen_result);
+      }
+      _push->_parsed = in.tell();
+      _push->_screen_parsed = true;
+      _push->_last_frame.emplace(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, 0, 0,
+                                 _dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height);
+      if (_push->_callbacks._on_screen) {
+         _push->_callbacks._on_screen(_dctx->_lsd, _dctx->_global_color_table);
+      }
+   }
+
+   while (!in.eof()) {
+      // A block cut off by the end of the data is parsed again from its start once more has arrived, so anything it
+      // added is taken back out
+      const std::size_t nframes = _dctx->_frames.size();
+      const std::size_t ncomments = _dctx->_comments.size();
+      const std::optional<graphics_control_extension> active_gce = _active_gce;
+      const std::optional<netscape_extension> nse = _dctx->_nse;
+
+      bool trailer_found = false;
+      gif_parse_result block_result = parse_block(in, trailer_found);
+      if (block_result == gif_parse_result::kUnexpectedEof) {
+         _dctx->_frames.resize(nframes);
+         _dctx->_comments.resize(ncomments);
+         _active_gce = active_gce;
+         _dctx->_nse = nse;
+         return gif_parse_result::kNeedMoreData;
+      }
+      if (block_result != gif_parse_result::kSuccess) {
+         return finish_push(block_result);
+      }
+      _push->_parsed = in.tell();
+
+      if (_dctx->_frames.size() > nframes && _push->_callbacks._on_frame) {
+         gif_frame_context const& frame_ctx = _dctx->_frames.back();
+         quant::gif_frame decode_frame = decode_image(frame_ctx, *_push->_last_frame);
+         _push->_callbacks._on_frame(decode_frame, frame_ctx, _dctx->_global_color_table);
+         apply_disposal_method(frame_ctx, std::move(decode_frame), *_push->_last_frame);
+      }
+      if (trailer_found) {
+         if (_push->_callbacks._on_trailer) {
+            _push->_callbacks._on_trailer();
+         }
+         return finish_push(gif_parse_result::kSuccess);
+      }
+   }
+   return gif_parse_result::kNeedMoreData;
+}
+
+gif_parse_result gif::finish_push(gif_parse_result result) {
+   _push->_result = result;
+   _push->_last_frame = std::nullopt;
+   return result;
+}
+
+gif_parse_result gif::parse_image_data(util::byte_reader& in, std::optional<graphics_control_extension> const& gce) {
+   gif_frame_context& new_frame = _dctx->_frames.emplace_back();
+   new_frame._frame_number = _dctx->_frames.size() - 1;
+   new_frame._extension = gce;
+
+   if (!stream_read(in, &new_frame._descriptor)) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+
+   new_frame._local_color_table_start = in.tell();
+   if (new_frame._descriptor._lct_present && !in.skip(color_table_size(new_frame._descriptor._lct_size))) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+
+   if (!stream_read(in, &new_frame._min_code_size)) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   if (new_frame._min_code_size < 2 || new_frame._min_code_size > 8) {
+      return gif_parse_result::kInvalidCodeSize;
+   }
+
+   new_frame._image_data_start = in.tell();
+   // Skip image data to be loaded later, noting the sub-block layout on the way past. The layout is only kept once
+   // all of the blocks are known to be in the file.
+   util::subblock_index data_index;
+   gif_parse_result skip_result = for_each_subblock(in, [&data_index] (uint8_t const*, uint16_t len) {
+         data_index.add_block(len);
+         return gif_parse_result::kSuccess;
+      });
+   if (skip_result == gif_parse_result::kSuccess) {
+      new_frame._data_index = data_index;
+   }
+   return skip_result;
+}
+
+gif_parse_result gif::parse_screen(util::byte_reader& in) {
+   auto version_opt = parse_gif_version(in);
    if (!version_opt) {
       return gif_parse_result::kInvalidHeader;
    }
    _dctx->_version = *version_opt;
 
-   if (!stream_read(_raw_ifile, &_dctx->_lsd)) {
+   if (!stream_read(in, &_dctx->_lsd)) {
       return gif_parse_result::kUnexpectedEof;
    }
 
    if (_dctx->_lsd._gct_present &&
-       !read_color_table(_raw_ifile, _dctx->_lsd._gct_size, _dctx->_global_color_table)) {
+       !read_color_table(in, _dctx->_lsd._gct_size, _dctx->_global_color_table)) {
       return gif_parse_result::kUnexpectedEof;
    }
+   return gif_parse_result::kSuccess;
+}
 
-   // With the heading information out of the way, now we need to process a series of frames & extension blocks
-   bool trailer_found = false;
-   std::size_t frame_num = 0;
-   while (!trailer_found && !_raw_ifile.eof()) {
-      auto next_block = stream_read<uint8_t>(_raw_ifile);
-      if (!next_block) {
-         return gif_parse_result::kUnexpectedEof;
-      }
+gif_parse_result gif::parse_block(util::byte_reader& in, bool& trailer_found) {
+   // Keeps comments and frames, see read_block
+   struct contents_visitor {
+      gif& _gif;
 
-      bool destroy_active_gce = _active_gce.has_value();
+      gif_parse_result comment(util::byte_reader& in) {
+         std::string& comment_out = _gif._dctx->_comments.emplace_back();
+         return for_each_subblock(in, [&comment_out] (uint8_t const* data, uint16_t len) {
+               comment_out.append(reinterpret_cast<char const*>(data), len);
+               return gif_parse_result::kSuccess;
+            });
+      }
 
-      gif_parse_result block_parse_result = gif_parse_result::kSuccess;
-      switch (*next_block) {
-         case kExtensionIntroducer:
-            if (_dctx->_version != gif_version::kGif89a) {
-               return gif_parse_result::kNotSupported;
-            }
-            block_parse_result = parse_extension();
-            break;
-         case kImageSeparator:
-            block_parse_result = parse_image_data(frame_num);
-            frame_num++;
-            break;
-         case kGifTrailer:
-            trailer_found = true;
-            break;
+      gif_parse_result image(util::byte_reader& in, std::optional<graphics_control_extension> const& gce) {
+         return _gif.parse_image_data(in, gce);
       }
+   };
+   return read_block(in, _dctx->_version, _active_gce, _dctx->_nse, trailer_found, contents_visitor { *this });
+}
+
+gif_parse_result gif::parse_contents() {
+   util::byte_reader in(_input);
+   _dctx = std::make_unique<deserialized_gif_context>();
+   _ctx_debug = _dctx.get();
+   gif_parse_result screen_result = parse_screen(in);
+   if (screen_result != gif_parse_result::kSuccess) {
+      return screen_result;
+   }
 
+   // With the heading information out of the way, now we need to process a series of frames & extension blocks
+   bool trailer_found = false;
+   while (!trailer_found && !in.eof()) {
+      gif_parse_result block_parse_result = parse_block(in, trailer_found);
       if (block_parse_result != gif_parse_result::kSuccess) {
          return block_parse_result;
       }
+   }
+   return trailer_found ? gif_parse_result::kSuccess : gif_parse_result::kUnexpectedEof;
+}
+
+gif_parse_result probe(std::string_view path, gif_summary& summary) {
+   util::mapped_file file;
+   if (!file.open(path)) {
+      return gif_parse_result::kFileNotFound;
+   }
+   return probe(file.data(), summary);
+}
 
-      if (destroy_active_gce) {
-         _active_gce = std::nullopt;
+gif_parse_result probe(util::byte_span data, gif_summary& summary) {
+   util::byte_reader in(data);
+   summary = gif_summary();
+   auto version_opt = parse_gif_version(in);
+   if (!version_opt) {
+      return gif_parse_result::kInvalidHeader;
+   }
+   logical_screen_descriptor lsd;
+   if (!stream_read(in, &lsd)) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+   summary._canvas_width = lsd._canvas_width;
+   summary._canvas_height = lsd._canvas_height;
+   if (lsd._gct_present && !in.skip(color_table_size(lsd._gct_size))) {
+      return gif_parse_result::kUnexpectedEof;
+   }
+
+   std::optional<graphics_control_extension> active_gce;
+   std::optional<netscape_extension> nse;
+   bool trailer_found = false;
+   while (!trailer_found && !in.eof()) {
+      gif_parse_result block_parse_result = read_block(in, *version_opt, active_gce, nse, trailer_found,
+                                                       summary_visitor { summary });
+      if (block_parse_result != gif_parse_result::kSuccess) {
+         return block_parse_result;
       }
    }
+   if (nse) {
+      summary._loop_count = nse->_loop_count;
+   }
    return trailer_found ? gif_parse_result::kSuccess : gif_parse_result::kUnexpectedEof;
 }
 
-quant::gif_frame gif::decode_image(gif_frame_context const& frame_ctx, quant::gif_frame const& last_frame) const {
-   std::vector<uint8_t> compressed_data, decompressed_data;
-   _raw_ifile.seekg(frame_ctx._image_data_start);
-   for_each_subblock(_raw_ifile, [&compressed_data] (uint8_t* data, uint16_t len) {
-         compressed_data.insert(compressed_data.end(), data, data + len);
-         return gif_parse_result::kSuccess;
+void probe_batch(util::thread_pool& pool, std::vector<std::string> const& paths, std::size_t max_open,
+                 std::vector<gif_parse_result>& results, std::vector<gif_summary>& summaries) {
+   results.assign(paths.size(), gif_parse_result::kSuccess);
+   summaries.assign(paths.size(), gif_summary());
+   // Each of max_open lanes probes one file at a time, taking the next path once it is done with the last, so no more
+   // than max_open files are ever open no matter how large the pool is
+   std::atomic<std::size_t> next_path = 0;
+   pool.parallel_for(std::min(std::max<std::size_t>(max_open, 1), paths.size()), [&] (std::size_t) {
+         for (std::size_t i = next_path++; i < paths.size(); i = next_path++) {
+            results[i] = probe(paths[i], summaries[i]);
+         }
       });
-   lzw::lzw_decode_result result = lzw::lzw_decompress(compressed_data, decompressed_data, frame_ctx._min_code_size);
+}
+
+color_table_view gif::view_local_color_table(gif_frame_context const& frame_ctx) const {
+   if (!frame_ctx._descriptor._lct_present) {
+      return color_table_view();
+   }
+   uint8_t const* table_data = _input._data + frame_ctx._local_color_table_start;
+   return color_table_view(reinterpret_cast<color_table_entry const*>(table_data),
+                           std::size_t{1} << (frame_ctx._descriptor._lct_size + 1));
+}
 
+std::vector<color_table_entry> gif::local_color_table(gif_frame_context const& frame_ctx) const {
+   const color_table_view table = view_local_color_table(frame_ctx);
+   return std::vector<color_table_entry>(table.begin(), table.end());
+}
+
+void gif::decode_indices(gif_frame_context const& frame_ctx, lzw::lzw_decoder& decoder, decoded_indices& out) const {
+   out._indices.resize(static_cast<std::size_t>(frame_ctx._descriptor._image_width) *
+                       frame_ctx._descriptor._image_height);
+   util::span_block_source block_source(_input, frame_ctx._image_data_start);
+   util::subblock_istream<util::span_block_source> compressed_data(block_source);
+   const lzw::lzw_decode_result result = decoder.decompress_indices(
+         compressed_data, util::mutable_byte_span(out._indices.data(), out._indices.size()), frame_ctx._min_code_size);
+   out._ndecoded = util::to_byte(result._bits_written);
+}
+
+quant::gif_frame gif::decode_image(gif_frame_context const& frame_ctx, quant::gif_frame const& last_frame,
+                                   decoded_indices* decoded) const {
    std::optional<uint8_t> transparent_index = std::nullopt;
    std::optional<gif_disposal_method> disposal_method = std::nullopt;
    if (frame_ctx._extension) {
@@ -351,37 +694,349 @@ quant::gif_frame gif::decode_image(gif_frame_context const& frame_ctx, quant::gi
                           std::nullopt;
       disposal_method = frame_ctx._extension->_disposal_method;
    }
-   quant::qimg quant_frame(std::move(decompressed_data), frame_ctx._min_code_size, result._bits_written,
-                           frame_ctx._descriptor._image_left_pos, frame_ctx._descriptor._image_top_pos,
-                           frame_ctx._descriptor._image_width, frame_ctx._descriptor._image_height, transparent_index);
    quant::dequant_params params(frame_ctx._descriptor._interlaced, disposal_method);
 
+   // With no color table at all, canvas_ostream draws every index black
+   color_table_view palette;
    if (frame_ctx._descriptor._lct_present) {
-      quant_frame._palette = frame_ctx._local_color_table;
+      palette = view_local_color_table(frame_ctx);
    } else if (_dctx->_lsd._gct_present) {
-      quant_frame._palette = _dctx->_global_color_table;
+      palette = _dctx->_global_color_table;
    } else {
       assert(false);
    }
 
-   quant::gif_frame new_frame(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, quant_frame._x, quant_frame._y,
-                              quant_frame._w, quant_frame._h);
-
+   quant::gif_frame new_frame(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height,
+                              frame_ctx._descriptor._image_left_pos, frame_ctx._descriptor._image_top_pos,
+                              frame_ctx._descriptor._image_width, frame_ctx._descriptor._image_height);
    prepare_frame(new_frame, params, last_frame);
-   dequantize_from(new_frame, params, quant_frame);
+
+   if (decoded) {
+      quant::canvas_ostream canvas_out(new_frame, params, palette, transparent_index,
+                                       util::mutable_byte_span(decoded->_indices.data(), decoded->_indices.size()));
+      canvas_out.skip_decoded(decoded->_ndecoded);
+      canvas_out.finish();
+      return new_frame;
+   }
+
+   // LZW output goes straight onto the canvas, the index buffer only backs the decoder's copies of earlier output
+   std::vector<uint8_t>& index_scratch = _dctx->_index_scratch;
+   index_scratch.resize(static_cast<std::size_t>(frame_ctx._descriptor._image_width) *
+                        frame_ctx._descriptor._image_height);
+   quant::canvas_ostream canvas_out(new_frame, params, palette, transparent_index,
+                                    util::mutable_byte_span(index_scratch.data(), index_scratch.size()));
+   if (_pool && index_scratch.size() >= kMinParallelPixels) {
+      util::subblock_index const& data_index = frame_ctx._data_index;
+      util::byte_span compressed_data;
+      if (data_index._nblocks == 1) {
+         compressed_data = util::single_subblock(_input, frame_ctx._image_data_start, data_index);
+      } else {
+         std::vector<uint8_t>& compressed_scratch = _dctx->_compressed_scratch;
+         compressed_scratch.resize(data_index._payload_size);
+         util::gather_subblocks(_input, frame_ctx._image_data_start, data_index, compressed_scratch.data());
+         compressed_data = compressed_scratch;
+      }
+      const lzw::lzw_decode_result result = lzw::lzw_decompress_indices_parallel(
+            *_pool, compressed_data, util::mutable_byte_span(index_scratch.data(), index_scratch.size()),
+            frame_ctx._min_code_size, lzw::parallel_decompress_params(kMinParallelPixels));
+      canvas_out.skip_decoded(util::to_byte(result._bits_written));
+   } else {
+      util::span_block_source block_source(_input, frame_ctx._image_data_start);
+      util::subblock_istream<util::span_block_source> compressed_data(block_source);
+      _dctx->_decoder.decompress_indices(compressed_data, canvas_out, frame_ctx._min_code_size);
+   }
+   canvas_out.finish();
    return new_frame;
 }
 
+void gif::apply_disposal_method(gif_frame_context const& frame_ctx, quant::gif_frame&& frame,
+                                quant::gif_frame& last_frame) const {
+   if (frame_ctx._extension) {
+      if (frame_ctx._extension->_disposal_method == gif_disposal_method::kRestoreToBackground) {
+         frame.clear_active();
+      }
+      if (frame_ctx._extension->_disposal_method != gif_disposal_method::kRestoreToPrevious) {
+         last_frame = std::move(frame);
+      }
+   } else {
+      last_frame = std::move(frame);
+   }
+}
+
+bool gif::independent_of_previous(std::size_t frame_number) const {
+   if (frame_number == 0) {
+      return true;
+   }
+   gif_frame_context const& frame_ctx = _dctx->_frames[frame_number];
+   const auto covers_canvas = [this] (image_descriptor const& desc) {
+      return desc._image_left_pos == 0 && desc._image_top_pos == 0 &&
+             desc._image_width >= _dctx->_lsd._canvas_width && desc._image_height >= _dctx->_lsd._canvas_height;
+   };
+
+   // prepare_frame only starts from the canvas before for these disposal methods
+   if (!frame_ctx._extension) {
+      return true;
+   }
+   switch (frame_ctx._extension->_disposal_method) {
+      case gif_disposal_method::kDoNotDispose:
+      case gif_disposal_method::kRestoreToBackground:
+      case gif_disposal_method::kRestoreToPrevious:
+         break;
+      default:
+         return true;
+   }
+   // And even then, an opaque frame over the whole canvas paints over all of it
+   if (!frame_ctx._extension->_transparent_enabled && covers_canvas(frame_ctx._descriptor)) {
+      return true;
+   }
+   // Or the frame before cleared the whole canvas once it was shown, leaving the same blank canvas as the first frame
+   gif_frame_context const& previous = _dctx->_frames[frame_number - 1];
+   return previous._extension && previous._extension->_disposal_method == gif_disposal_method::kRestoreToBackground &&
+          covers_canvas(previous._descriptor);
+}
+
+gif::seek_context& gif::seek_state() {
+   if (!_seek) {
+      _seek = std::make_unique<seek_context>();
+      _seek->_start_times.push_back(0);
+      _seek->_checkpoint_bytes = 0;
+      _seek->_use_count = 0;
+      _seek->_cursor_frame = 0;
+   }
+   // A push read can have added frames since the last seek
+   std::vector<uint64_t>& start_times = _seek->_start_times;
+   for (std::size_t i = start_times.size() - 1; i < _dctx->_frames.size(); i++) {
+      std::optional<graphics_control_extension> const& gce = _dctx->_frames[i]._extension;
+      start_times.push_back(start_times.back() + (gce ? gce->_delay_time : 0));
+   }
+   return *_seek;
+}
+
+void gif::add_checkpoint(std::size_t frame_number, quant::gif_frame const& canvas) {
+   seek_context& seek = *_seek;
+   const std::size_t nbytes = canvas._img.size() * sizeof(pixel);
+   if (nbytes > _seek_budget) {
+      return;
+   }
+   while (seek._checkpoint_bytes + nbytes > _seek_budget) {
+      auto oldest = std::min_element(seek._checkpoints.begin(), seek._checkpoints.end(),
+                                     [] (auto const& lhs, auto const& rhs) {
+                                        return lhs.second._last_used < rhs.second._last_used;
+                                     });
+      seek._checkpoint_bytes -= oldest->second._canvas._img.size() * sizeof(pixel);
+      seek._checkpoints.erase(oldest);
+   }
+   seek._checkpoints.emplace(frame_number, seek_checkpoint { canvas, ++seek._use_count });
+   seek._checkpoint_bytes += nbytes;
+}
+
+void gif::set_seek_checkpoints(std::size_t interval, std::size_t budget) {
+   _seek_interval = interval;
+   _seek_budget = budget;
+   if (_seek) {
+      _seek->_checkpoints.clear();
+      _seek->_checkpoint_bytes = 0;
+   }
+}
+
+quant::gif_frame gif::seek_frame(std::size_t frame_number) {
+   assert(frame_number < _dctx->_frames.size());
+   seek_context& seek = seek_state();
+
+   // Walk back to the closest frame that can be decoded without any before it
+   std::optional<quant::gif_frame> last_frame;
+   std::size_t start = frame_number;
+   for (;; start--) {
+      if (seek._cursor && seek._cursor_frame == start) {
+         last_frame = std::move(seek._cursor);
+         seek._cursor = std::nullopt;
+         break;
+      }
+      auto checkpoint = seek._checkpoints.find(start);
+      if (checkpoint != seek._checkpoints.end()) {
+         checkpoint->second._last_used = ++seek._use_count;
+         last_frame.emplace(checkpoint->second._canvas);
+         break;
+      }
+      if (independent_of_previous(start)) {
+         last_frame.emplace(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, 0, 0,
+                            _dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height);
+         break;
+      }
+   }
+
+   for (std::size_t i = start;; i++) {
+      gif_frame_context const& frame_ctx = _dctx->_frames[i];
+      if (i != start && _seek_interval > 0 && i % _seek_interval == 0 && !independent_of_previous(i) &&
+          seek._checkpoints.count(i) == 0) {
+         add_checkpoint(i, *last_frame);
+      }
+      quant::gif_frame decode_frame = decode_image(frame_ctx, *last_frame);
+      if (i == frame_number) {
+         // Left for the next seek, so seeking forward a frame at a time decodes each frame once
+         quant::gif_frame shown(decode_frame);
+         apply_disposal_method(frame_ctx, std::move(decode_frame), *last_frame);
+         seek._cursor = std::move(last_frame);
+         seek._cursor_frame = i + 1;
+         return shown;
+      }
+      apply_disposal_method(frame_ctx, std::move(decode_frame), *last_frame);
+   }
+}
+
+std::size_t gif::frame_at_time(uint64_t time) {
+   assert(!_dctx->_frames.empty());
+   std::vector<uint64_t> const& start_times = seek_state()._start_times;
+   // The last frame starting at or before time, skipping the total duration on the end
+   auto next = std::upper_bound(start_times.begin(), start_times.end() - 1, time);
+   return static_cast<std::size_t>(next - start_times.begin()) - 1;
+}
+
+void gif::foreach_frame_parallel(gif_frame_callback const& exec) {
+   std::vector<gif_frame_context> const& frames = _dctx->_frames;
+   const std::size_t lookahead = std::min(_decode_lookahead, frames.size());
+
+   // One frame's LZW decode, shared with the pool task queued for it. Whichever of the task and the compositing thread
+   // claims it first decodes it, so the compositing thread never waits on the pool to get around to a frame, which it
+   // may never do when this is called from within a task on the same pool. A task finding its job already claimed
+   // returns without touching anything but the job.
+   struct decode_job {
+      decoded_indices _decoded;
+      std::atomic<bool> _claimed = false;
+      bool _done = false;
+      std::mutex _mutex;
+      std::condition_variable _finished;
+   };
+   // Frame i's job sits in slot i % lookahead until the frame has been composited. Frames that decode_image splits up
+   // across the pool itself are decoded when composited instead and have no job.
+   std::vector<std::shared_ptr<decode_job>> slots(lookahead);
+
+   // A task still decoding reads from this gif, so none are left running once this returns or exec throws. Jobs not
+   // started yet are claimed so they never will be.
+   struct job_drain {
+      std::vector<std::shared_ptr<decode_job>>& _slots;
+
+      ~job_drain() {
+         for (std::shared_ptr<decode_job> const& job : _slots) {
+            if (job && job->_claimed.exchange(true)) {
+               std::unique_lock<std::mutex> lock(job->_mutex);
+               job->_finished.wait(lock, [&job] { return job->_done; });
+            }
+         }
+      }
+   } drain { slots };
+
+   const auto start_decode = [&] (std::size_t frame_number) {
+      gif_frame_context const& frame_ctx = frames[frame_number];
+      std::shared_ptr<decode_job>& slot = slots[frame_number % lookahead];
+      if (static_cast<std::size_t>(frame_ctx._descriptor._image_width) * frame_ctx._descriptor._image_height >=
+          kMinParallelPixels) {
+         slot = nullptr;
+         return;
+      }
+      std::shared_ptr<decode_job> job = std::make_shared<decode_job>();
+      if (slot) {
+         // The index buffer of the frame just composited is reused
+         job->_decoded._indices = std::move(slot->_decoded._indices);
+      }
+      slot = job;
+      _pool->submit([this, &frame_ctx, job] {
+            if (job->_claimed.exchange(true)) {
+               return;
+            }
+            decode_indices(frame_ctx, thread_decoder(), job->_decoded);
+            std::lock_guard<std::mutex> lock(job->_mutex);
+            job->_done = true;
+            job->_finished.notify_all();
+         });
+   };
+
+   // Decodes the job here if no task has started on it, otherwise waits for the task to finish
+   const auto finish_decode = [this] (decode_job& job, gif_frame_context const& frame_ctx) {
+      if (!job._claimed.exchange(true)) {
+         decode_indices(frame_ctx, thread_decoder(), job._decoded);
+         std::lock_guard<std::mutex> lock(job._mutex);
+         job._done = true;
+         return;
+      }
+      std::unique_lock<std::mutex> lock(job._mutex);
+      job._finished.wait(lock, [&job] { return job._done; });
+   };
+
+   for (std::size_t i = 0; i < lookahead; i++) {
+      start_decode(i);
+   }
+   quant::gif_frame last_frame(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, 0, 0,
+                               _dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height);
+   for (std::size_t i = 0; i < frames.size(); i++) {
+      decode_job* job = slots[i % lookahead].get();
+      if (job) {
+         finish_decode(*job, frames[i]);
+      }
+      quant::gif_frame decode_frame = decode_image(frames[i], last_frame, job ? &job->_decoded : nullptr);
+      if (i + lookahead < frames.size()) {
+         start_decode(i + lookahead);
+      }
+      exec(decode_frame, frames[i], _dctx->_global_color_table);
+      apply_disposal_method(frames[i], std::move(decode_frame), last_frame);
+   }
+}
+
+std::vector<std::size_t> gif::independent_segments() const {
+   std::vector<std::size_t> starts;
+   if (!_dctx) {
+      return starts;
+   }
+   for (std::size_t i = 0; i < _dctx->_frames.size(); i++) {
+      if (independent_of_previous(i)) {
+         starts.push_back(i);
+      }
+   }
+   return starts;
+}
+
+std::vector<quant::gif_frame> gif::composite_all_frames() {
+   std::vector<quant::gif_frame> all_frames;
+   const std::vector<std::size_t> starts = independent_segments();
+   if (!_pool || starts.size() < 2) {
+      foreach_frame([&all_frames] (quant::gif_frame const& frame, gif_frame_context const&,
+                                   std::vector<color_table_entry> const&) {
+            all_frames.push_back(frame);
+         });
+      return all_frames;
+   }
+
+   // Segments are composited the same way as foreach_frame, but LZW decode on their own thread, since the decoder and
+   // index buffer kept in _dctx can only be used by one thread at a time
+   std::vector<gif_frame_context> const& frames = _dctx->_frames;
+   std::vector<std::optional<quant::gif_frame>> composited(frames.size());
+   _pool->parallel_for(starts.size(), [&] (std::size_t segment) {
+         const std::size_t end = segment + 1 < starts.size() ? starts[segment + 1] : frames.size();
+         decoded_indices decoded;
+         quant::gif_frame last_frame(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, 0, 0,
+                                     _dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height);
+         for (std::size_t i = starts[segment]; i < end; i++) {
+            decode_indices(frames[i], thread_decoder(), decoded);
+            quant::gif_frame decode_frame = decode_image(frames[i], last_frame, &decoded);
+            composited[i].emplace(decode_frame);
+            apply_disposal_method(frames[i], std::move(decode_frame), last_frame);
+         }
+      });
+
+   all_frames.reserve(frames.size());
+   for (std::optional<quant::gif_frame>& frame : composited) {
+      all_frames.push_back(std::move(*frame));
+   }
+   return all_frames;
+}
+
 void gif::open_write(std::string_view path) {
    _sctx = std::make_unique<serialized_gif_context>();
    _sctx->_max_w = 0;
    _sctx->_max_h = 0;
    _sctx->_required_version = gif_version::kGif87a;
+   _sctx->_gct_entries = 0;
    _raw_ofile.open(path.data(), std::ios::binary);
-   // Buffer space for our header and LSD, filled on final write
-   std::fill_n(std::ostream_iterator<char>(_raw_ofile), sizeof(gif_header) + sizeof(logical_screen_descriptor), 0);
-   std::fill_n(std::ostream_iterator<char>(_raw_ofile), 256 * sizeof(color_table_entry), 0);
-   std::fill_n(std::ostream_iterator<char>(_raw_ofile), 3 + sizeof(application_extension) + 5, 0);
 }
 
 void gif::add_frame(piximg const& frame, std::optional<uint16_t> delay) {
@@ -396,21 +1051,88 @@ void gif::add_frame(quant::qimg const& quant_frame, std::optional<uint16_t> dela
    _sctx->_max_w = quant_frame._w;
    _sctx->_max_h = quant_frame._h;
 
-   if (quant_frame._t_index || delay) {
+   // Indices one per byte, unpacking them if the quantizer packed them
+   const std::size_t npixels = quant_frame._nbits / quant_frame._bpp;
+   std::vector<uint8_t>& index_scratch = _sctx->_index_scratch;
+   util::byte_span indices(quant_frame._index.data(), npixels);
+   if (quant_frame._bpp != 8) {
+      index_scratch.resize(npixels);
+      util::bit_reader reader(quant_frame._index.data(), quant_frame._index.size(), quant_frame._nbits);
+      for (uint8_t& index : index_scratch) {
+         index = static_cast<uint8_t>(reader.read(quant_frame._bpp));
+      }
+      indices = util::byte_span(index_scratch.data(), npixels);
+   }
+
+   std::array<bool, 256> used = {};
+   for (std::size_t i = 0; i < indices._size; i++) {
+      used[indices._data[i]] = true;
+   }
+   std::optional<uint8_t> t_index = quant_frame._t_index;
+   if (t_index) {
+      used[*t_index] = true;
+   }
+
+   // A local table keeps only the colors its frame uses, moved down to the lowest indices. The global table is shared
+   // between frames, so a frame using it only sizes its codes to the highest index it uses.
+   const bool local_table = !quant_frame._palette.empty();
+   std::vector<color_table_entry>& palette = _sctx->_palette_scratch;
+   palette.clear();
+   std::array<uint8_t, 256> remap;
+   std::size_t nentries = 0;
+   bool compacted = false;
+   for (std::size_t i = 0; i < used.size(); i++) {
+      if (!used[i]) {
+         continue;
+      }
+      if (local_table) {
+         compacted |= i != nentries;
+         remap[i] = static_cast<uint8_t>(nentries++);
+         palette.push_back(i < quant_frame._palette.size() ? quant_frame._palette[i] : color_table_entry {0, 0, 0});
+      } else {
+         nentries = i + 1;
+      }
+   }
+   if (compacted) {
+      index_scratch.resize(npixels);
+      for (std::size_t i = 0; i < npixels; i++) {
+         index_scratch[i] = remap[indices._data[i]];
+      }
+      indices = util::byte_span(index_scratch.data(), npixels);
+      if (t_index) {
+         t_index = remap[*t_index];
+      }
+   }
+   if (!local_table) {
+      _sctx->_gct_entries = std::max(_sctx->_gct_entries, nentries);
+   }
+   const uint8_t table_bits = color_table_bits(nentries);
+   // LZW codes start one bit wider than the indices, but the minimum code size is 2 even for 2 color tables
+   const uint8_t code_size = std::max<uint8_t>(table_bits + 1, 2);
+
+   std::vector<uint8_t>& body = _sctx->_body;
+   const std::size_t frame_bound = sizeof(graphics_control_extension) + sizeof(image_descriptor) + 16 +
+                                   sizeof(color_table_entry) * palette.size() * 2 +
+                                   util::subblock_bound(lzw::lzw_compress_bound(npixels, code_size));
+   if (body.capacity() < body.size() + frame_bound) {
+      body.reserve(std::max(body.size() + frame_bound, body.capacity() * 2));
+   }
+
+   if (t_index || delay) {
       _sctx->_required_version = gif_version::kGif89a;
 
       graphics_control_extension gce;
-      gce._transparent_enabled = quant_frame._t_index.has_value();
+      gce._transparent_enabled = t_index.has_value();
       gce._user_input = false;
       gce._disposal_method = gif_disposal_method::kNone;
       gce._reserved_0 = 0;
       gce._delay_time = delay ? *delay : 0;
-      gce._transparent_index = *quant_frame._t_index;
-      _raw_ofile.put(kExtensionIntroducer);
-      _raw_ofile.put(kGraphicsExtensionLabel);
-      _raw_ofile.put(sizeof(graphics_control_extension));
-      _raw_ofile.write(reinterpret_cast<const char*>(&gce), sizeof(graphics_control_extension));
-      _raw_ofile.put(0);
+      gce._transparent_index = t_index ? *t_index : 0;
+      body.push_back(kExtensionIntroducer);
+      body.push_back(kGraphicsExtensionLabel);
+      body.push_back(sizeof(graphics_control_extension));
+      buffer_write(body, gce);
+      body.push_back(0);
    }
 
    {
@@ -419,52 +1141,54 @@ void gif::add_frame(quant::qimg const& quant_frame, std::optional<uint16_t> dela
       desc._image_top_pos = quant_frame._y;
       desc._image_width = quant_frame._w;
       desc._image_height = quant_frame._h;
-      desc._lct_size = 0;
+      desc._lct_size = local_table ? table_bits : 0;
       desc._reserved_1 = 0;
       desc._sorted = true;
       desc._interlaced = false;
-      desc._lct_present = !quant_frame._palette.empty();
-      _raw_ofile.put(kImageSeparator);
-      _raw_ofile.write(reinterpret_cast<const char*>(&desc), sizeof(image_descriptor));
-
-      if (desc._lct_present) {
-         const int pad_to = 256 * sizeof(color_table_entry);
-         for (color_table_entry const& cte : quant_frame._palette) {
-            _raw_ofile.write(reinterpret_cast<const char*>(&cte), sizeof(color_table_entry));
-         }
-         
-         std::fill_n(std::ostream_iterator<char>(_raw_ofile),
-                     pad_to - (sizeof(color_table_entry) * quant_frame._palette.size()),
-                     0);
+      desc._lct_present = local_table;
+      body.push_back(kImageSeparator);
+      buffer_write(body, desc);
+
+      if (local_table) {
+         const std::size_t table_size = (std::size_t{2} << table_bits) * sizeof(color_table_entry);
+         uint8_t const* table = reinterpret_cast<uint8_t const*>(palette.data());
+         body.insert(body.end(), table, table + palette.size() * sizeof(color_table_entry));
+         body.resize(body.size() + table_size - palette.size() * sizeof(color_table_entry), 0);
       }
    }
 
    {
-      constexpr auto subblock_write = [](std::vector<uint8_t> const& data, std::ofstream& file) {
-         constexpr std::size_t kMaxBlockSz = 255;
-         for (std::size_t i = 0; i < data.size(); i += kMaxBlockSz) {
-            std::size_t block_size = (i + kMaxBlockSz) > data.size() ? data.size() - i : kMaxBlockSz;
-            file.put(static_cast<char>(block_size));
-            file.write(reinterpret_cast<const char*>(data.data() + i), block_size);
-         }
-         file.put(0);
-      };
-
-      std::vector<uint8_t> compressed_frame;
-      lzw::lzw_compress(quant_frame._index, quant_frame._nbits, quant_frame._bpp, compressed_frame);
-      _raw_ofile.put(quant_frame._bpp);
-      subblock_write(compressed_frame, _raw_ofile);
+      // At 8bpp the trie no longer fits in cache and the hash table is faster, below that the trie is (see
+      // bench_lzw_compressors in test.cc)
+      const lzw::compress_method method = code_size == 8 ? lzw::compress_method::kHashTable :
+                                                           lzw::compress_method::kTrie;
+      // The image data goes through sub-block framing straight into the buffered body
+      body.push_back(code_size);
+      util::subblock_ostream frame_out(body);
+      std::vector<color_table_entry> const& lossy_palette = local_table ? palette : _lossy_gct;
+      if (_lossy_distance > 0 && !lossy_palette.empty()) {
+         _sctx->_encoder.compress_indices_lossy(indices, code_size,
+                                                lzw::lossy_params(lossy_palette, _lossy_distance, t_index), frame_out,
+                                                _clear_policy);
+      } else if (_pool) {
+         lzw::lzw_compress_indices_parallel(*_pool, indices, code_size, frame_out,
+                                            lzw::parallel_compress_params(kMinParallelPixels, method,
+                                                                          _clear_policy));
+      } else {
+         _sctx->_encoder.compress_indices(indices, code_size, frame_out, method, _clear_policy);
+      }
    }
 }
 
 void gif::finish_write() {
+   finish_write(std::vector<color_table_entry>());
+}
+
+void gif::finish_write(std::vector<color_table_entry> const& gct) {
    if (_sctx == nullptr || !_raw_ofile.is_open()) {
       return;
    }
 
-   _raw_ofile.put(kGifTrailer);
-   _raw_ofile.seekp(0, std::ios::beg);
-
    gif_header header;
    if (_sctx->_required_version == gif_version::kGif87a) {
       std::copy(kGif87Magic.begin(), kGif87Magic.end(), header._version);
@@ -473,19 +1197,23 @@ void gif::finish_write() {
    }
    _raw_ofile.write(reinterpret_cast<const char*>(&header), sizeof(gif_header));
 
+   // The global table is left out when no frame uses it, otherwise it is cut down to cover the indices used
+   const uint8_t gct_bits = color_table_bits(_sctx->_gct_entries);
    logical_screen_descriptor lsd;
    lsd._canvas_width = _sctx->_max_w;
    lsd._canvas_height = _sctx->_max_h;
-   lsd._gct_size = 7;
+   lsd._gct_size = gct_bits;
    lsd._sort_flag = false;
    lsd._color_resolution = 0;
-   lsd._gct_present = true;
+   lsd._gct_present = _sctx->_gct_entries > 0;
    lsd._bg_color_index = 0;
    lsd._pixel_aspect_ratio = 0;
 
    _raw_ofile.write(reinterpret_cast<const char*>(&lsd), sizeof(logical_screen_descriptor));
+   if (lsd._gct_present) {
+      write_color_table(_raw_ofile, gct, gct_bits);
+   }
 
-   _raw_ofile.seekp(sizeof(gif_header) + sizeof(logical_screen_descriptor) + 256 * sizeof(color_table_entry));
    application_extension ext;
    std::copy(kNetscapeId.begin(), kNetscapeId.end(), ext._application_identifier);
    std::copy(kNetscapeAuth.begin(), kNetscapeAuth.end(), ext._authentication_code);
@@ -498,14 +1226,10 @@ void gif::finish_write() {
    _raw_ofile.put(0);
    _raw_ofile.put(0);
    _raw_ofile.put(0);
-}
 
-void gif::finish_write(std::vector<color_table_entry> const& gct) {
-   finish_write();
-   _raw_ofile.seekp(sizeof(gif_header) + sizeof(logical_screen_descriptor));
-   for (color_table_entry const& e : gct) {
-      _raw_ofile.write(reinterpret_cast<const char*>(&e), sizeof(color_table_entry));
-   }
+   _raw_ofile.write(reinterpret_cast<const char*>(_sctx->_body.data()), _sctx->_body.size());
+   _raw_ofile.put(kGifTrailer);
+   _sctx->_body = std::vector<uint8_t>();
 }
 
 }
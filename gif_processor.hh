@@ -2,14 +2,21 @@
 
 #include <cstdint>
 #include <fstream>
+#include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "gif_spec.hh"
+#include "lzw.hh"
+#include "mapped_file.hh"
 #include "quant_base.hh"
+#include "subblock.hh"
+#include "thread_pool.hh"
 
 namespace gifproc {
 
@@ -23,15 +30,40 @@ enum gif_parse_result {
    kMissingBlockTerminator,
    kInvalidApplicationData,
    kInvalidBlockSize,
+   // An image's LZW minimum code size was outside 2 to 8
+   kInvalidCodeSize,
+   // Only from gif::push_read, when the data pushed so far ends partway through the file
+   kNeedMoreData,
 };
 
 struct gif_frame_context {
    std::size_t _frame_number;
    std::optional<graphics_control_extension> _extension;
    image_descriptor _descriptor;
-   std::vector<color_table_entry> _local_color_table;
+   // Offset into the file of the local color table, if _descriptor._lct_present, see gif::local_color_table. It is
+   // left in the file rather than copied out of it for every frame.
+   std::size_t _local_color_table_start;
    uint8_t _min_code_size;
-   std::streampos _image_data_start;
+   // Offset into the file of the frame's first data sub-block
+   std::size_t _image_data_start;
+   // Where the rest of the data sub-blocks are, so they can be gathered in one go
+   util::subblock_index _data_index;
+};
+
+// Called with each frame in order by gif::foreach_frame
+using gif_frame_callback = std::function<void(quant::gif_frame const&, gif_frame_context const&,
+                                              std::vector<color_table_entry> const&)>;
+
+// Called from within gif::push_read as each part of the file is completed, any of these may be left empty. References
+// passed in are only valid for the duration of the call.
+struct gif_push_callbacks {
+   // The logical screen descriptor and global color table
+   std::function<void(logical_screen_descriptor const&, std::vector<color_table_entry> const&)> _on_screen;
+   // Each frame once its descriptor and all of its data have arrived, decoded and composited the same as in
+   // gif::foreach_frame. Frames are only decoded if this is set.
+   gif_frame_callback _on_frame;
+   // The trailer, after which the gif is open the same as after open_read
+   std::function<void()> _on_trailer;
 };
 
 // Structure for managing components of a gif in-memory. All modifications are kept in-memory until explicitly
@@ -48,6 +80,13 @@ private:
 
       std::vector<std::string> _comments;
       std::optional<netscape_extension> _nse;
+
+      // Kept between frames so decoding doesn't reallocate the LZW codebooks or index buffer each time
+      lzw::lzw_decoder _decoder;
+      std::vector<uint8_t> _index_scratch;
+      // Only used when decoding in parallel, which needs the compressed data in one piece, and only if it is split
+      // across more than one sub-block
+      std::vector<uint8_t> _compressed_scratch;
    };
 
    std::unique_ptr<deserialized_gif_context> _dctx;
@@ -58,22 +97,96 @@ private:
       std::size_t _max_w;
       std::size_t _max_h;
       gif_version _required_version;
+
+      // Frames are held here until finish_write, once the size of the global color table is known
+      std::vector<uint8_t> _body;
+      // Highest index used into the global color table, plus one
+      std::size_t _gct_entries;
+
+      // Kept between frames, the same as deserialized_gif_context::_decoder
+      lzw::lzw_encoder _encoder;
+      std::vector<uint8_t> _index_scratch;
+      std::vector<color_table_entry> _palette_scratch;
    };
    std::unique_ptr<serialized_gif_context> _sctx;
 
-   mutable std::ifstream _raw_ifile;
+   struct push_context {
+      gif_push_callbacks _callbacks;
+      // Everything before this offset into the data has been parsed
+      std::size_t _parsed;
+      bool _screen_parsed;
+      // The canvas after the last frame passed to _on_frame
+      std::optional<quant::gif_frame> _last_frame;
+      // Set once the trailer or an error has been reached, and returned from every push_read after
+      std::optional<gif_parse_result> _result;
+   };
+   std::unique_ptr<push_context> _push;
+
+   struct seek_checkpoint {
+      // The canvas before the frame it is kept for, as decode_image takes it
+      quant::gif_frame _canvas;
+      // When it was last seeked from, so the least recently used is dropped first
+      std::size_t _last_used;
+   };
+   struct seek_context {
+      // When each frame starts, in hundredths of a second, one past the last frame being the total duration
+      std::vector<uint64_t> _start_times;
+      // Keyed by the frame each one comes before
+      std::map<std::size_t, seek_checkpoint> _checkpoints;
+      std::size_t _checkpoint_bytes;
+      std::size_t _use_count;
+      // The canvas before frame _cursor_frame, where the last seek left off
+      std::optional<quant::gif_frame> _cursor;
+      std::size_t _cursor_frame;
+   };
+   std::unique_ptr<seek_context> _seek;
+
+   // The file being read is held by one of these, and parsed and decoded through _input
+   util::mapped_file _mapped_ifile;
+   std::vector<uint8_t> _owned_ifile;
+   util::byte_span _input;
    mutable std::ofstream _raw_ofile;
 
+   // Not owned, nullptr if everything is done on the calling thread
+   util::thread_pool* _pool;
+   lzw::clear_policy _clear_policy;
+   // 0 when frames are compressed losslessly, see set_lossy
+   uint32_t _lossy_distance;
+   std::vector<color_table_entry> _lossy_gct;
+   // See set_decode_lookahead
+   std::size_t _decode_lookahead;
+   // See set_seek_checkpoints
+   std::size_t _seek_interval;
+   std::size_t _seek_budget;
+
    gif_parse_result parse_contents();
-   gif_parse_result parse_extension();
-   gif_parse_result parse_image_data(std::size_t frame_number);
+   gif_parse_result parse_screen(util::byte_reader& in);
+   gif_parse_result parse_block(util::byte_reader& in, bool& trailer_found);
+   gif_parse_result parse_image_data(util::byte_reader& in, std::optional<graphics_control_extension> const& gce);
+
+   // A frame's indices, LZW decoded ahead of being composited
+   struct decoded_indices {
+      std::vector<uint8_t> _indices;
+      std::size_t _ndecoded;
+   };
 
-   gif_parse_result parse_application_extension();
+   // The frame's local color table where it is in the file data, which is only valid until more is pushed
+   color_table_view view_local_color_table(gif_frame_context const& frame_ctx) const;
+   // LZW decodes the frame with decoder, which can be done on any thread
+   void decode_indices(gif_frame_context const& frame_ctx, lzw::lzw_decoder& decoder, decoded_indices& out) const;
+   // Composites the frame over last_frame, LZW decoding it first unless it is given already decoded
+   quant::gif_frame decode_image(gif_frame_context const& frame_ctx, quant::gif_frame const& last_frame,
+                                 decoded_indices* decoded = nullptr) const;
+   void foreach_frame_parallel(gif_frame_callback const& exec);
+   // Moves frame into last_frame once it has been shown, unless its disposal method restores the frame before it
+   void apply_disposal_method(gif_frame_context const& frame_ctx, quant::gif_frame&& frame,
+                              quant::gif_frame& last_frame) const;
+   gif_parse_result finish_push(gif_parse_result result);
 
-   quant::gif_frame decode_image(gif_frame_context const& frame_ctx, quant::gif_frame const& last_frame) const;
-   void apply_disposal_method(gif_frame_context const& frame_ctx,
-                              quant::gif_frame const& previous_frame,
-                              quant::gif_frame& frame);
+   // Whether the frame comes out the same no matter what was decoded before it, so it can be decoded on its own
+   bool independent_of_previous(std::size_t frame_number) const;
+   seek_context& seek_state();
+   void add_checkpoint(std::size_t frame_number, quant::gif_frame const& canvas);
 
 public:
    gif();
@@ -82,12 +195,43 @@ public:
    gif(gif const&) = delete;
    gif& operator=(gif const&) = delete;
 
+   // Maps the file into memory, frames are decoded straight out of the mapping
    gif_parse_result open_read(std::string_view path);
+   // Reads the rest of stream into memory up front
    gif_parse_result open_read(std::ifstream&& stream);
+   // Parses and decodes data in place without copying it, the caller must keep it alive and unchanged for as long as
+   // this reads from it
+   gif_parse_result open_read(util::byte_span data);
+
+   // Reads a file handed over in pieces as they arrive, such as an upload. Each push_read copies chunk onto the end
+   // of the data so far and parses as far as it can, calling into callbacks for whatever it completes. push_read
+   // returns kNeedMoreData until the trailer is reached, kSuccess from then on, or the first error in the file. If
+   // the data runs out while it still wants more, the file was truncated.
+   void begin_push_read(gif_push_callbacks callbacks);
+   gif_parse_result push_read(util::byte_span chunk);
+
+   // Lets work within a frame be split across pool, which must outlive this or be unset first. Large frames are LZW
+   // compressed and decompressed in parallel.
+   void set_thread_pool(util::thread_pool* pool) { _pool = pool; }
+   // With a thread pool, foreach_frame LZW decodes up to nframes frames on the pool ahead of the one being composited,
+   // each into its own index buffer. Frames large enough to be split up within the frame are still decoded when they
+   // come up. 0 decodes every frame as it comes up.
+   void set_decode_lookahead(std::size_t nframes) { _decode_lookahead = nframes; }
+   // When frames added after this clear the LZW dictionary, see lzw::clear_policy
+   void set_clear_policy(lzw::clear_policy policy) { _clear_policy = policy; }
+   // Frames added after this are compressed lossily, see lzw::lossy_params, or losslessly again with a max_distance of
+   // 0. Frames with a local color table are matched against it, frames on the global table against gct, which should
+   // be the table later given to finish_write. Without gct those frames stay lossless.
+   void set_lossy(uint32_t max_distance, std::vector<color_table_entry> gct = {}) {
+      _lossy_distance = max_distance;
+      _lossy_gct = std::move(gct);
+   }
 
    uint16_t width() const { return _dctx->_lsd._canvas_width; }
    uint16_t height() const { return _dctx->_lsd._canvas_height; }
    std::size_t nframes() const { return _dctx->_frames.size(); }
+   // A copy of the frame's local color table, empty without one
+   std::vector<color_table_entry> local_color_table(gif_frame_context const& frame_ctx) const;
 
    // Apply disposal method to each frame_ctx
    template <typename T>
@@ -95,25 +239,38 @@ public:
       if (!_dctx) {
          return;
       }
+      if (_pool && _decode_lookahead > 0 && _dctx->_frames.size() > 1) {
+         foreach_frame_parallel(std::ref(exec));
+         return;
+      }
       quant::gif_frame last_frame(_dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height, 0, 0,
                                   _dctx->_lsd._canvas_width, _dctx->_lsd._canvas_height);
 
       for (gif_frame_context const& frame_ctx : _dctx->_frames) {
          quant::gif_frame decode_frame = decode_image(frame_ctx, last_frame);
          exec(decode_frame, frame_ctx, _dctx->_global_color_table);
-         if (frame_ctx._extension) {
-            if (frame_ctx._extension->_disposal_method == gif_disposal_method::kRestoreToBackground) {
-               decode_frame.clear_active();
-            }
-            if (frame_ctx._extension->_disposal_method != gif_disposal_method::kRestoreToPrevious) {
-               last_frame = std::move(decode_frame);
-            }
-         } else {
-            last_frame = std::move(decode_frame);
-         }
+         apply_disposal_method(frame_ctx, std::move(decode_frame), last_frame);
       }
    }
 
+   // Random access, for when frames aren't wanted in order. The canvas before every interval-th frame is kept as
+   // seek_frame decodes past it, with the least recently used dropped once they would take more than budget bytes.
+   // Frames that don't depend on the canvas before them need no checkpoint. Drops the checkpoints already kept.
+   void set_seek_checkpoints(std::size_t interval, std::size_t budget);
+   // Frame frame_number as foreach_frame would pass it to exec, decoded starting from the closest checkpoint,
+   // independent frame or last seek before it
+   quant::gif_frame seek_frame(std::size_t frame_number);
+   // The frame on screen time hundredths of a second into the animation by the frames' delay times, or the last frame
+   // past the end
+   std::size_t frame_at_time(uint64_t time);
+
+   // The first frame of each run of frames that can be composited without any frame before the run, see
+   // independent_of_previous. Always starts with frame 0 if there are any frames.
+   std::vector<std::size_t> independent_segments() const;
+   // Every frame, as foreach_frame would pass them to exec. With a thread pool, each independent segment is composited
+   // on its own thread.
+   std::vector<quant::gif_frame> composite_all_frames();
+
    // Writing
    void open_write(std::string_view path);
    void add_frame(piximg const& frame, std::optional<uint16_t> delay = std::nullopt);
@@ -121,5 +278,32 @@ public:
    void finish_write();
    void finish_write(std::vector<color_table_entry> const& gct);
 };
+
+// Timing of one frame, as found by probe
+struct gif_frame_summary {
+   // In hundredths of a second, 0 for a frame without a graphics control extension
+   uint16_t _delay_time;
+   gif_disposal_method _disposal_method;
+};
+
+// What probe finds out about a gif without decoding it
+struct gif_summary {
+   uint16_t _canvas_width;
+   uint16_t _canvas_height;
+   std::vector<gif_frame_summary> _frames;
+   // Only set by a netscape looping extension, where 0 loops forever
+   std::optional<uint16_t> _loop_count;
+   // Sum of the frame delays, in hundredths of a second
+   uint64_t _total_duration;
+};
+
+// Reads only the screen descriptor and extensions of a gif, skipping over color tables and image data without building
+// the frame contexts that gif::open_read does. Frames get the same delays and disposal methods as they would there.
+gif_parse_result probe(std::string_view path, gif_summary& summary);
+gif_parse_result probe(util::byte_span data, gif_summary& summary);
+// Probes every file in paths across pool, with at most max_open of them open at a time. results and summaries are
+// filled with one entry per path.
+void probe_batch(util::thread_pool& pool, std::vector<std::string> const& paths, std::size_t max_open,
+                 std::vector<gif_parse_result>& results, std::vector<gif_summary>& summaries);
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
 
 namespace gifproc {
 
@@ -10,6 +12,40 @@ struct color_table_entry {
    uint8_t _green;
    uint8_t _blue;
 };
+#pragma pack(pop)
+
+// A color table held elsewhere, either a vector or the table as stored in the file
+class color_table_view {
+private:
+   color_table_entry const* _data;
+   std::size_t _size;
+
+public:
+   constexpr color_table_view() : _data(nullptr), _size(0) {}
+   constexpr color_table_view(color_table_entry const* data, std::size_t size) : _data(data), _size(size) {}
+   color_table_view(std::vector<color_table_entry> const& table) : _data(table.data()), _size(table.size()) {}
+
+   constexpr color_table_entry const* data() const {
+      return _data;
+   }
+   constexpr std::size_t size() const {
+      return _size;
+   }
+   constexpr bool empty() const {
+      return _size == 0;
+   }
+   constexpr color_table_entry const& operator[](std::size_t i) const {
+      return _data[i];
+   }
+   constexpr color_table_entry const* begin() const {
+      return _data;
+   }
+   constexpr color_table_entry const* end() const {
+      return _data + _size;
+   }
+};
+
+#pragma pack(push, 1)
 
 struct logical_screen_descriptor {
    uint16_t _canvas_width;
@@ -40,6 +76,7 @@ constexpr uint8_t kPlaintextExtensionLabel = 0x01;
 constexpr uint8_t kApplicationExtensionLabel = 0xff;
 constexpr uint8_t kCommentExtensionLabel = 0xfe;
 constexpr uint8_t kBlockTerminator = 0x00;
+constexpr std::size_t kMaxSubblockSize = 255;
 
 struct extension_introducer {
    uint8_t _introducer_magic;
@@ -1,10 +1,14 @@
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
 #include <memory>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 #include <optional>
 
+#include "dequantize.hh"
 #include "lzw.hh"
 
 namespace gifproc::lzw {
@@ -14,6 +18,7 @@ using gifproc::util::bitfld;
 using codebook_reference = uint16_t;
 using lzw_bitfld = bitfld<uint16_t>;
 
+constexpr std::size_t kMaxCodeBits = 12;
 
 struct lookup_result {
    constexpr static uint16_t kEOFUnit = 0xffff;
@@ -41,6 +46,12 @@ protected:
       return clear_code() + 1;
    }
 
+   // Width of the code written after the last code of the input. The decoder adds an entry for the last code before
+   // reading it, while the compressor never adds one, so this is one wider than the last code at powers of two.
+   constexpr uint8_t get_end_bitsize() const {
+      return 32 - __builtin_clz(static_cast<unsigned int>(std::min(_codebook_size, kHighestCodebookEntry)));
+   }
+
    _codebook_base(std::size_t initial_size) : _codebook_size(initial_size) {}
 
 public:
@@ -64,7 +75,7 @@ private:
       }
    };
 
-   codebook_entry _codebook_head;
+   // Single unit entries double as the root of the trie, since a unit's code is the unit itself
    std::array<codebook_entry, base_type::kMaxCodebookEntries> _codebook_table;
 
    compress_codebook() : _codebook_base<_Bits>(base_type::eoi_code() + 1) {
@@ -79,13 +90,9 @@ private:
    }
 
    void reset_codebook() {
-      _codebook_head.initialize();
       for (uint16_t i = 0; i < base_type::_codebook_size; i++) {
          _codebook_table[i].initialize(i);
       }
-      for (std::size_t i = 0; i < _codebook_head._connections.size(); i++) {
-         _codebook_head._connections[i] = static_cast<uint16_t>(i);
-      }
    }
 
 public:
@@ -93,46 +100,99 @@ public:
       return std::unique_ptr<compress_codebook<_Bits>>(new compress_codebook<_Bits>());
    }
 
+   // Back to the state of a newly allocated codebook, only the root entries need to be touched
+   void reset() {
+      base_type::_codebook_size = base_type::eoi_code() + 1;
+      reset_codebook();
+   }
+
    constexpr lzw_bitfld clear_code_now() const {
       return util::create_nbits(base_type::clear_code(), get_write_bitsize());
    }
 
+   // Clear code taking the place of the EOI code, at the same width
+   constexpr lzw_bitfld end_clear_code() const {
+      return util::create_nbits(base_type::clear_code(), base_type::get_end_bitsize());
+   }
+
+   // Every code has been assigned, which only happens when clears are deferred
+   constexpr bool full() const {
+      return base_type::_codebook_size == base_type::kMaxCodebookEntries;
+   }
+
+   // Resets the codebook, returning the clear code to write for it
+   lzw_bitfld clear_now() {
+      const lzw_bitfld ret = clear_code_now();
+      reset();
+      return ret;
+   }
+
    // Does the operation of looking up an entry, breaking at the first miss
-   // Moves the bitstream position to the location of the miss
-   lookup_result lookup_phase_1(util::cbw_istream<_Bits>& data_stream) const {
-      uint16_t unit = data_stream.read_extract();
-      uint16_t table_index = codebook_entry::kInvalidConnection;
-
-      codebook_entry const* it = &_codebook_head;
-      while (it->_connections[unit] != codebook_entry::kInvalidConnection &&
-             !data_stream.eof()) {
-         it = &_codebook_table[table_index = it->_connections[unit]];
-         unit = data_stream.read_extract();
-      }
-      // If we reach EOF and the last unit makes up a fully mapped sequence
-      if (it->_connections[unit] != codebook_entry::kInvalidConnection) {
-         const uint16_t final_index = it->_connections[unit];
-         return lookup_result(util::create_nbits<uint16_t>(
-                                 _codebook_table[final_index]._codebook_value,
-                                 get_write_bitsize()),
-                              final_index,
-                              lookup_result::kEOFUnit);
-      }
-      data_stream.rewind(1);
-      
-      return lookup_result(util::create_nbits(it->_codebook_value, get_write_bitsize()), table_index, unit);
+   // Leaves the stream positioned at the unit which missed, which is only peeked at. _In is a cbw_istream<_Bits> or an
+   // index_istream.
+   template <typename _In>
+   lookup_result lookup_phase_1(_In& data_stream) const {
+      uint16_t table_index = data_stream.read_extract();
+
+      while (!data_stream.eof()) {
+         const uint16_t unit = data_stream.peek_extract();
+         const uint16_t next_index = _codebook_table[table_index]._connections[unit];
+         if (next_index == codebook_entry::kInvalidConnection) {
+            return lookup_result(util::create_nbits(_codebook_table[table_index]._codebook_value, get_write_bitsize()),
+                                 table_index,
+                                 unit);
+         }
+         data_stream.consume();
+         table_index = next_index;
+      }
+      // We reached EOF and the last unit makes up a fully mapped sequence
+      return lookup_result(util::create_nbits(_codebook_table[table_index]._codebook_value, get_write_bitsize()),
+                           table_index,
+                           lookup_result::kEOFUnit);
+   }
+
+   // lookup_phase_1 for lossy compression, when the next unit has no connection _Matcher (a lossy_matcher) may pick
+   // another connected unit to follow in its place
+   template <typename _In, typename _Matcher>
+   lookup_result lookup_phase_1(_In& data_stream, _Matcher& matcher) const {
+      uint16_t table_index = data_stream.read_extract();
+      matcher.keep();
+
+      while (!data_stream.eof()) {
+         const uint16_t unit = data_stream.peek_extract();
+         codebook_entry const& entry = _codebook_table[table_index];
+         uint16_t next_index = entry._connections[unit];
+         if (next_index == codebook_entry::kInvalidConnection) {
+            next_index = matcher.substitute(unit, entry._connections);
+            if (next_index == codebook_entry::kInvalidConnection) {
+               return lookup_result(util::create_nbits(entry._codebook_value, get_write_bitsize()), table_index, unit);
+            }
+         } else {
+            matcher.keep();
+         }
+         data_stream.consume();
+         table_index = next_index;
+      }
+      return lookup_result(util::create_nbits(_codebook_table[table_index]._codebook_value, get_write_bitsize()),
+                           table_index,
+                           lookup_result::kEOFUnit);
    }
 
    // Does the operation of adding the new entry, signaling EOI, and signaling clear code
-   std::optional<lzw_bitfld> lookup_phase_2(lookup_result const& last_result) {
+   // With defer_clear, a full codebook is kept as it is instead of being cleared, see clear_policy
+   std::optional<lzw_bitfld> lookup_phase_2(lookup_result const& last_result, bool defer_clear) {
       if (last_result._miss == lookup_result::kEOFUnit) {
          // Signal we need to write an EOI code
-         return util::create_nbits(base_type::eoi_code(), get_write_bitsize());
+         return util::create_nbits(base_type::eoi_code(), base_type::get_end_bitsize());
       }
 
       const uint16_t next_code = base_type::_codebook_size;
 
-      if (next_code == base_type::kHighestCodebookEntry) {
+      if (defer_clear) {
+         if (full()) {
+            return std::nullopt;
+         }
+      } else if (next_code == base_type::kHighestCodebookEntry) {
          // Signal that we need to write a clear code
          lzw_bitfld ret = util::create_nbits(base_type::clear_code(), get_write_bitsize());
 
@@ -150,41 +210,398 @@ public:
    }
 };
 
+// hash_codebook produces the same codes as compress_codebook, but stores its dictionary as an open-addressed hash table
+// of (prefix code, unit) -> code instead of a trie with a full connection array per entry. The table is 32KB regardless
+// of _Bits (the trie is 2MB at 8bpp), and adding an entry writes 4 bytes instead of initializing a connection array.
+template <std::size_t _Bits>
+class hash_codebook : public _codebook_base<_Bits> {
+private:
+   using base_type = _codebook_base<_Bits>;
+
+   // At most 4096 entries are live, so the table never goes past half full
+   constexpr static std::size_t kTableBits = 13;
+   constexpr static std::size_t kTableMask = (std::size_t{1} << kTableBits) - 1;
+   constexpr static uint16_t kNoCode = 0xffff;
+   // Slots hold the key above the code, the key (prefix << _Bits | unit) fits in 20 bits and the code in 12. An empty
+   // slot would be prefix 4095 at 8bpp, which is only assigned once the codebook is full and never has entries added.
+   constexpr static uint32_t kEmptySlot = 0xffffffff;
+
+   std::array<uint32_t, std::size_t{1} << kTableBits> _table;
+
+   hash_codebook() : _codebook_base<_Bits>(base_type::eoi_code() + 1) {
+      reset_codebook();
+   }
+
+   constexpr uint8_t get_write_bitsize() const {
+      return 32 - __builtin_clz(static_cast<unsigned int>(base_type::_codebook_size - 1));
+   }
+
+   constexpr static uint32_t make_key(uint16_t prefix, uint16_t unit) {
+      return (static_cast<uint32_t>(prefix) << _Bits) | unit;
+   }
+
+   constexpr static std::size_t slot_of(uint32_t key) {
+      return (key * uint32_t{0x9e3779b1}) >> (32 - kTableBits);
+   }
+
+   uint16_t find(uint16_t prefix, uint16_t unit) const {
+      const uint32_t key = make_key(prefix, unit);
+      for (std::size_t slot = slot_of(key);; slot = (slot + 1) & kTableMask) {
+         const uint32_t entry = _table[slot];
+         if (entry == kEmptySlot) {
+            return kNoCode;
+         } else if ((entry >> kMaxCodeBits) == key) {
+            return static_cast<uint16_t>(entry & ((1 << kMaxCodeBits) - 1));
+         }
+      }
+   }
+
+   void insert(uint16_t prefix, uint16_t unit, uint16_t code) {
+      const uint32_t key = make_key(prefix, unit);
+      std::size_t slot = slot_of(key);
+      while (_table[slot] != kEmptySlot) {
+         slot = (slot + 1) & kTableMask;
+      }
+      _table[slot] = (key << kMaxCodeBits) | code;
+   }
+
+   // Single unit sequences are never stored, their code is the unit itself
+   void reset_codebook() {
+      _table.fill(kEmptySlot);
+   }
+
+public:
+   static std::unique_ptr<hash_codebook<_Bits>> alloc_codebook() {
+      return std::unique_ptr<hash_codebook<_Bits>>(new hash_codebook<_Bits>());
+   }
+
+   void reset() {
+      base_type::_codebook_size = base_type::eoi_code() + 1;
+      reset_codebook();
+   }
+
+   constexpr lzw_bitfld clear_code_now() const {
+      return util::create_nbits(base_type::clear_code(), get_write_bitsize());
+   }
+
+   // Clear code taking the place of the EOI code, at the same width
+   constexpr lzw_bitfld end_clear_code() const {
+      return util::create_nbits(base_type::clear_code(), base_type::get_end_bitsize());
+   }
+
+   // Every code has been assigned, which only happens when clears are deferred
+   constexpr bool full() const {
+      return base_type::_codebook_size == base_type::kMaxCodebookEntries;
+   }
+
+   // Resets the codebook, returning the clear code to write for it
+   lzw_bitfld clear_now() {
+      const lzw_bitfld ret = clear_code_now();
+      reset();
+      return ret;
+   }
+
+   // Same as compress_codebook::lookup_phase_1
+   template <typename _In>
+   lookup_result lookup_phase_1(_In& data_stream) const {
+      uint16_t code = data_stream.read_extract();
+
+      while (!data_stream.eof()) {
+         const uint16_t unit = data_stream.peek_extract();
+         const uint16_t next_code = find(code, unit);
+         if (next_code == kNoCode) {
+            return lookup_result(util::create_nbits(code, get_write_bitsize()), code, unit);
+         }
+         data_stream.consume();
+         code = next_code;
+      }
+      return lookup_result(util::create_nbits(code, get_write_bitsize()), code, lookup_result::kEOFUnit);
+   }
+
+   // Same as compress_codebook::lookup_phase_2
+   std::optional<lzw_bitfld> lookup_phase_2(lookup_result const& last_result, bool defer_clear) {
+      if (last_result._miss == lookup_result::kEOFUnit) {
+         return util::create_nbits(base_type::eoi_code(), base_type::get_end_bitsize());
+      }
+
+      const uint16_t next_code = base_type::_codebook_size;
+
+      if (defer_clear) {
+         if (full()) {
+            return std::nullopt;
+         }
+      } else if (next_code == base_type::kHighestCodebookEntry) {
+         lzw_bitfld ret = util::create_nbits(base_type::clear_code(), get_write_bitsize());
+         reset();
+         return ret;
+      }
+
+      insert(last_result._entry, last_result._miss, next_code);
+      base_type::_codebook_size++;
+
+      return std::nullopt;
+   }
+};
+
+// Picks the units lossy compression follows in place of the input, see lossy_params
+class lossy_matcher {
+private:
+   constexpr static uint16_t kNoConnection = 0xffff;
+   constexpr static std::size_t kChannels = 3;
+
+   std::array<std::array<int32_t, kChannels>, 256> _colors;
+   // Units which are only ever matched exactly
+   std::array<bool, 256> _fixed;
+   int32_t _max_distance_sq;
+   // Error left over from the last swap, which the next unit's color is shifted by before matching
+   std::array<int32_t, kChannels> _carry;
+
+public:
+   explicit lossy_matcher(lossy_params const& params)
+         : _fixed(), _max_distance_sq(static_cast<int32_t>(std::min<uint32_t>(params._max_distance, 1024))),
+           _carry() {
+      _max_distance_sq *= _max_distance_sq;
+      for (std::size_t i = 0; i < _colors.size(); i++) {
+         color_table_entry const color = i < params._palette.size() ? params._palette[i] : color_table_entry {0, 0, 0};
+         _colors[i] = { color._red, color._green, color._blue };
+      }
+      if (params._transparent_index) {
+         _fixed[*params._transparent_index] = true;
+      }
+   }
+
+   // The unit was matched as it is, so the carried error is only halved
+   void keep() {
+      for (int32_t& carry : _carry) {
+         carry /= 2;
+      }
+   }
+
+   // Returns the connection to follow in place of unit, or kNoConnection if none is close enough
+   template <std::size_t _N>
+   uint16_t substitute(uint16_t unit, std::array<uint16_t, _N> const& connections) {
+      if (_fixed[unit]) {
+         return kNoConnection;
+      }
+      std::array<int32_t, kChannels> target;
+      for (std::size_t c = 0; c < kChannels; c++) {
+         target[c] = _colors[unit][c] + _carry[c];
+      }
+
+      uint16_t best = kNoConnection;
+      int32_t best_distance_sq = _max_distance_sq + 1;
+      for (std::size_t candidate = 0; candidate < _N; candidate++) {
+         if (connections[candidate] == kNoConnection || _fixed[candidate]) {
+            continue;
+         }
+         int32_t distance_sq = 0;
+         for (std::size_t c = 0; c < kChannels; c++) {
+            const int32_t diff = target[c] - _colors[candidate][c];
+            distance_sq += diff * diff;
+         }
+         if (distance_sq < best_distance_sq) {
+            best_distance_sq = distance_sq;
+            best = static_cast<uint16_t>(candidate);
+         }
+      }
+      if (best == kNoConnection) {
+         return kNoConnection;
+      }
+      for (std::size_t c = 0; c < kChannels; c++) {
+         _carry[c] = (target[c] - _colors[best][c]) / 2;
+      }
+      return connections[best];
+   }
+};
+
+// A compress_codebook doing lossy lookups, which lzw_compress_generic can use in place of the codebook itself
+template <std::size_t _Bits>
+class lossy_codebook {
+private:
+   compress_codebook<_Bits>& _codebook;
+   lossy_matcher& _matcher;
+
+public:
+   lossy_codebook(compress_codebook<_Bits>& codebook, lossy_matcher& matcher)
+         : _codebook(codebook), _matcher(matcher) {}
+
+   lzw_bitfld clear_code_now() const {
+      return _codebook.clear_code_now();
+   }
+
+   lzw_bitfld end_clear_code() const {
+      return _codebook.end_clear_code();
+   }
+
+   bool full() const {
+      return _codebook.full();
+   }
+
+   lzw_bitfld clear_now() {
+      return _codebook.clear_now();
+   }
+
+   template <typename _In>
+   lookup_result lookup_phase_1(_In& data_stream) {
+      return _codebook.lookup_phase_1(data_stream, _matcher);
+   }
+
+   std::optional<lzw_bitfld> lookup_phase_2(lookup_result const& last_result, bool defer_clear) {
+      return _codebook.lookup_phase_2(last_result, defer_clear);
+   }
+};
+
+// Decides when to clear a full codebook under clear_policy::kRatioMonitored. Once the codebook fills up, the bits
+// written for each window of input units are compared against the rate from the last clear up to when it filled. That
+// rate includes building the codebook, so a window doing worse means the codebook no longer matches the data.
+class clear_monitor {
+private:
+   constexpr static std::size_t kWindowUnits = 4096;
+
+   // Start of the current run of codes, from the last clear
+   std::size_t _run_units;
+   std::size_t _run_bits;
+   // Length of the run when the codebook filled, both 0 until then
+   std::size_t _fill_units;
+   std::size_t _fill_bits;
+   std::size_t _window_units;
+   std::size_t _window_bits;
+
+public:
+   clear_monitor() : _run_units(0), _run_bits(0), _fill_units(0), _fill_bits(0), _window_units(0), _window_bits(0) {}
+
+   // units read and bits written so far in total
+   bool should_clear(bool full, std::size_t units, std::size_t bits) {
+      if (!full) {
+         return false;
+      }
+      if (_fill_units == 0) {
+         _fill_units = units - _run_units;
+         _fill_bits = bits - _run_bits;
+         _window_units = units;
+         _window_bits = bits;
+         return false;
+      }
+      if (units - _window_units < kWindowUnits) {
+         return false;
+      }
+      // window bits / window units > fill bits / fill units
+      const bool worse = (bits - _window_bits) * _fill_units > _fill_bits * (units - _window_units);
+      _window_units = units;
+      _window_bits = bits;
+      return worse;
+   }
+
+   void cleared(std::size_t units, std::size_t bits) {
+      _run_units = units;
+      _run_bits = bits;
+      _fill_units = 0;
+      _fill_bits = 0;
+   }
+};
+
 // lzw_compress_generic:
 //    Compresses a stream of bits into a variable LZW format conforming to gif89a specification.
 //    This includes clear & EOI codes.
-template <std::size_t _Bits>
-void lzw_compress_generic(util::cbw_istream<_Bits>& in, util::vbw_ostream& out) {
-   auto codebook = compress_codebook<_Bits>::alloc_codebook();
+//    _Codebook is a compress_codebook or hash_codebook, and must be freshly allocated or reset. _In is a cbw_istream of
+//    the codebook's bpp, or an index_istream. _Out is a vbw_ostream or a subblock_ostream.
+//    When compressing one segment of a larger stream (see lzw_compress_indices_parallel), leading_clear leaves out the
+//    initial clear code for segments following another, and trailing_eoi ends segments followed by another with a
+//    clear code instead of EOI. The clear code takes the place of the EOI so it is written at the same width.
+template <typename _Codebook, typename _In, typename _Out>
+void lzw_compress_generic(_Codebook& codebook, _In& in, _Out& out, clear_policy policy,
+                          bool leading_clear = true, bool trailing_eoi = true) {
+   const bool defer_clear = policy != clear_policy::kClearAtFull;
+   clear_monitor monitor;
 
    // Append initial clear-code
-   out.write(codebook->clear_code_now());
+   if (leading_clear) {
+      out.write(codebook.clear_code_now());
+   }
    while (!in.eof()) {
       // lookup_phase_1 will scan through the input stream until it finds a sequence not in its codebook.
       // The value of the last matched sequence's key will be returned in lookup_result::_output.
       // The codebook entry which the miss occurred at will be returned in lookup_result::_entry.
       // The stream unit which the miss occurred on will be returned in lookup_result::_miss.
-      lookup_result res = codebook->lookup_phase_1(in);
+      lookup_result res = codebook.lookup_phase_1(in);
       out.write(res._output);
 
       // lookup_phase_2 will write the new key to the dictionary, and possibly give us back an extra few bits to
       // write to our stream. extra will be one of either a clear code, signifying that phase 2 has cleared the
       // dictionary, or an EOI code, signifying that we've reached the end of our data stream.
-      auto extra = codebook->lookup_phase_2(res);
+      auto extra = codebook.lookup_phase_2(res, defer_clear);
       if (extra) {
-         out.write(*extra);
+         if (res._miss == lookup_result::kEOFUnit && !trailing_eoi) {
+            out.write(codebook.end_clear_code());
+         } else {
+            out.write(*extra);
+         }
+      } else if (policy == clear_policy::kRatioMonitored &&
+                 monitor.should_clear(codebook.full(), static_cast<std::size_t>(in.tell_index()), out.size())) {
+         out.write(codebook.clear_now());
+         monitor.cleared(static_cast<std::size_t>(in.tell_index()), out.size());
       }
    }
+   out.flush();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////// LZW DECOMPRESSION ///////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Shared state for decompressors, the code size & clear code handling is the same regardless of how the dictionary is
+// stored
 template <std::size_t _Bits>
-class decompress_codebook : _codebook_base<_Bits> {
+class _decompress_codebook_base : public _codebook_base<_Bits> {
+protected:
+   using base_type = _codebook_base<_Bits>;
+
+   _decompress_codebook_base() : _codebook_base<_Bits>(base_type::eoi_code() + 1) {}
+
+   constexpr bool deferring_clear_code() const {
+      return base_type::_codebook_size == base_type::kMaxCodebookEntries;
+   }
+
+   // The decompressor is always one step behind the compressor, so we need to adjust how we determine the bitsize
+   // we will read
+   constexpr uint8_t get_read_bitsize() const {
+      return 32 - __builtin_clz(static_cast<unsigned int>(deferring_clear_code() ?
+                                                          base_type::kHighestCodebookEntry :
+                                                          base_type::_codebook_size));
+   }
+
+   template <typename _In>
+   uint16_t read_code(_In& in) {
+      const uint8_t nbits = get_read_bitsize();
+      const uint16_t code = static_cast<uint16_t>(in.peek_extract(nbits));
+      in.consume(nbits);
+      return code;
+   }
+
+public:
+   template <typename _In, typename _Out>
+   decompress_status check_initial_clear_code(_In& in, _Out& out) {
+      if (in.eof()) {
+         return decompress_status::kUnexpectedEof;
+      }
+
+      const uint16_t start_code = read_code(in);
+      if (start_code != base_type::clear_code()) {
+         return decompress_status::kMissingInitialClearCode;
+      }
+
+      if (in.eof()) {
+         return decompress_status::kUnexpectedEof;
+      }
+      return decompress_status::kSuccess;
+   }
+};
+
+template <std::size_t _Bits>
+class decompress_codebook : public _decompress_codebook_base<_Bits> {
 private:
    using base_type = _codebook_base<_Bits>;
+   using decompress_base = _decompress_codebook_base<_Bits>;
 
    // codebook_entry defines a single node within the codebook trie
    // These entries are organized in a reverse-tree fashion (nodes point to their parents), and we re-build the
@@ -216,15 +633,14 @@ private:
    std::array<codebook_entry, base_type::kMaxCodebookEntries> _codebook_table;
    uint16_t _prev_code;
 
-   decompress_codebook()
-         : _codebook_base<_Bits>(base_type::eoi_code() + 1),
-           _prev_code(codebook_entry::kInvalidConnection) {
+   decompress_codebook() : _prev_code(codebook_entry::kInvalidConnection) {
       reset_codebook();
    }
 
    // Decompress a code by back-tracing the head of its sequence and caching the path, then running forward from the
    // head node
-   void decompress_impl(uint16_t code, util::cbw_ostream<_Bits>& out) {
+   template <typename _Out>
+   void decompress_impl(uint16_t code, _Out& out) {
       uint16_t cur_node = code;
       _codebook_table[cur_node]._tmp_next_entry = codebook_entry::kInvalidConnection;
 
@@ -250,46 +666,25 @@ private:
       }
    }
 
-   constexpr bool deferring_clear_code() const {
-      return base_type::_codebook_size == base_type::kMaxCodebookEntries;
-   }
-
-   // The decompressor is always one step behind the compressor, so we need to adjust how we determine the bitsize
-   // we will read
-   constexpr uint8_t get_read_bitsize() const {
-      return 32 - __builtin_clz(static_cast<unsigned int>(deferring_clear_code() ?
-                                                          base_type::kHighestCodebookEntry :
-                                                          base_type::_codebook_size));
-   }
-
 public:
    static std::unique_ptr<decompress_codebook<_Bits>> alloc_codebook() {
       return std::unique_ptr<decompress_codebook<_Bits>>(new decompress_codebook<_Bits>());
    }
 
-   decompress_status check_initial_clear_code(util::vbw_istream& in, util::cbw_ostream<_Bits>& out) {
-      if (in.eof()) {
-         return decompress_status::kUnexpectedEof;
-      }
-
-      const uint16_t start_code = static_cast<uint16_t>(in.read_extract(get_read_bitsize()));
-      if (start_code != base_type::clear_code()) {
-         return decompress_status::kMissingInitialClearCode;
-      }
-
-      if (in.eof()) {
-         return decompress_status::kUnexpectedEof;
-      }
-      return decompress_status::kSuccess;
+   void reset() {
+      base_type::_codebook_size = base_type::eoi_code() + 1;
+      _prev_code = codebook_entry::kInvalidConnection;
+      reset_codebook();
    }
 
-   decompress_status decompress_single_code(util::vbw_istream& in, util::cbw_ostream<_Bits>& out) {
+   template <typename _In, typename _Out>
+   decompress_status decompress_single_code(_In& in, _Out& out) {
       // Based on how this is called, this should not be hit, but it gives me peace of mind
       if (in.eof()) {
          return decompress_status::kUnexpectedEof;
       }
 
-      const uint16_t cur_code = static_cast<uint16_t>(in.read_extract(get_read_bitsize()));
+      const uint16_t cur_code = decompress_base::read_code(in);
       // Handle EOI and clear codes
       if (cur_code == base_type::eoi_code()) {
          in.seek_end();
@@ -320,7 +715,7 @@ public:
          out << _codebook_table[_prev_code]._base_index;
 
          // New dictionary entry consists of the start code of the previous sequence
-         if (!deferring_clear_code()) {
+         if (!decompress_base::deferring_clear_code()) {
             _codebook_table[base_type::_codebook_size].initialize(_prev_code,
                                                                   _codebook_table[_prev_code]._base_index,
                                                                   _codebook_table[_prev_code]._base_index);
@@ -334,7 +729,7 @@ public:
             // First, write out the decompressed code to our output stream
             decompress_impl(cur_code, out);
             // Then handle adding a new code to our codebook
-            if (!deferring_clear_code()) {
+            if (!decompress_base::deferring_clear_code()) {
                _codebook_table[base_type::_codebook_size].initialize(_prev_code,
                                                                      _codebook_table[cur_code]._base_index,
                                                                      _codebook_table[_prev_code]._base_index);
@@ -353,165 +748,713 @@ public:
 };
 
 
+// string_table_codebook decompresses into one byte per index, and instead of building a tree it records where in the
+// output each dictionary entry was last written. A code then expands to a copy of that earlier occurrence.
+// Each new entry is the previous code's output plus one more index, and the previous code's output is always directly
+// followed by the first index of the current code, so the entry is just the previous output with its length extended.
+template <std::size_t _Bits>
+class string_table_codebook : public _decompress_codebook_base<_Bits> {
+private:
+   using base_type = _codebook_base<_Bits>;
+   using decompress_base = _decompress_codebook_base<_Bits>;
+   constexpr static uint16_t kInvalidCode = 0xffff;
+
+   struct codebook_entry {
+      // Position in the output of an earlier occurrence of this entry, unused for single index entries
+      std::size_t _offset;
+      uint16_t _length;
+      uint8_t _base_index;
+   };
+
+   std::array<codebook_entry, base_type::kMaxCodebookEntries> _codebook_table;
+   uint16_t _prev_code;
+   // Where the previous code was written to, which the next dictionary entry will point at
+   std::size_t _prev_offset;
+
+   string_table_codebook() : _prev_code(kInvalidCode), _prev_offset(0) {
+      reset_codebook();
+   }
+
+   void reset_codebook() {
+      for (uint16_t i = 0; i < base_type::eoi_code() + 1; i++) {
+         _codebook_table[i] = codebook_entry { 0, 1, static_cast<uint8_t>(i) };
+      }
+   }
+
+   template <typename _Out>
+   void write_entry(codebook_entry const& entry, _Out& out) {
+      if (entry._length == 1) {
+         out << entry._base_index;
+      } else {
+         out.write_copy(entry._offset, entry._length);
+      }
+   }
+
+   void add_entry() {
+      if (!decompress_base::deferring_clear_code()) {
+         codebook_entry const& prev_entry = _codebook_table[_prev_code];
+         _codebook_table[base_type::_codebook_size] = codebook_entry {
+            _prev_offset, static_cast<uint16_t>(prev_entry._length + 1), prev_entry._base_index
+         };
+         base_type::_codebook_size++;
+      }
+   }
+
+public:
+   static std::unique_ptr<string_table_codebook<_Bits>> alloc_codebook() {
+      return std::unique_ptr<string_table_codebook<_Bits>>(new string_table_codebook<_Bits>());
+   }
+
+   // The root entries are never overwritten, so only the position state needs resetting
+   void reset() {
+      base_type::_codebook_size = base_type::eoi_code() + 1;
+      _prev_code = kInvalidCode;
+      _prev_offset = 0;
+   }
+
+   // _Out is an index_ostream, or anything else with write_copy and tell_unbounded
+   template <typename _In, typename _Out>
+   decompress_status decompress_single_code(_In& in, _Out& out) {
+      if (in.eof()) {
+         return decompress_status::kUnexpectedEof;
+      }
+
+      const uint16_t cur_code = decompress_base::read_code(in);
+      if (cur_code == base_type::eoi_code()) {
+         in.seek_end();
+         return decompress_status::kSuccess;
+      } else if (cur_code == base_type::clear_code()) {
+         base_type::_codebook_size = base_type::eoi_code() + 1;
+         _prev_code = kInvalidCode;
+         return decompress_status::kSuccess;
+      }
+
+      // Missing EOI, see decompress_codebook::decompress_single_code
+      if (in.eof()) {
+         return decompress_status::kUnexpectedEof;
+      }
+
+      const std::size_t cur_offset = out.tell_unbounded();
+      if (cur_code == base_type::_codebook_size) {
+         // The code being defined right now, which is the previous output followed by its own first index
+         if (_prev_code >= base_type::_codebook_size) {
+            return decompress_status::kInvalidCompressCode;
+         }
+         codebook_entry const& prev_entry = _codebook_table[_prev_code];
+         write_entry(prev_entry, out);
+         out << prev_entry._base_index;
+         add_entry();
+      } else if (cur_code < base_type::_codebook_size) {
+         write_entry(_codebook_table[cur_code], out);
+         if (_prev_code != kInvalidCode) {
+            add_entry();
+         }
+      } else {
+         return decompress_status::kInvalidCompressCode;
+      }
+
+      _prev_code = cur_code;
+      _prev_offset = cur_offset;
+
+      return decompress_status::kSuccess;
+   }
+};
+
+// A run of codes starting at a clear code, which can be decoded without anything that came before it
+struct clear_segment {
+   // Just past the clear code starting the segment
+   std::size_t _start_bit;
+   // Just past the clear code ending the segment, or the EOI
+   std::size_t _end_bit;
+   std::size_t _out_offset;
+   std::size_t _out_length;
+};
+
+// clear_code_scanner finds the clear codes in a stream without building the dictionary. Code widths only depend on how
+// many entries have been added since the last clear, and the number of indices a code expands to only on the lengths
+// of earlier entries, so it only needs a table of lengths. This also gives where each segment's output starts.
 template <std::size_t _Bits>
-decompress_status lzw_decompress_generic(util::vbw_istream& in, util::cbw_ostream<_Bits>& out) {
-   auto codebook = decompress_codebook<_Bits>::alloc_codebook();
+class clear_code_scanner : public _decompress_codebook_base<_Bits> {
+private:
+   using base_type = _codebook_base<_Bits>;
+   using decompress_base = _decompress_codebook_base<_Bits>;
+   constexpr static uint16_t kInvalidCode = 0xffff;
+
+   std::array<uint16_t, base_type::kMaxCodebookEntries> _lengths;
+   uint16_t _prev_code;
+
+   constexpr uint16_t length_of(uint16_t code) const {
+      return code < base_type::clear_code() ? 1 : _lengths[code];
+   }
+
+   void add_entry() {
+      if (!decompress_base::deferring_clear_code()) {
+         _lengths[base_type::_codebook_size] = length_of(_prev_code) + 1;
+         base_type::_codebook_size++;
+      }
+   }
 
-   decompress_status status = codebook->check_initial_clear_code(in, out);
+public:
+   clear_code_scanner() : _prev_code(kInvalidCode) {}
+
+   // Splits in into segments, false if the stream is invalid or ends without an EOI code
+   bool scan(util::vbw_istream& in, std::vector<clear_segment>& segments) {
+      std::size_t out_offset = 0;
+      while (!in.eof()) {
+         const uint16_t cur_code = decompress_base::read_code(in);
+         if (cur_code == base_type::clear_code() || cur_code == base_type::eoi_code()) {
+            if (!segments.empty()) {
+               segments.back()._end_bit = in.tell();
+               segments.back()._out_length = out_offset - segments.back()._out_offset;
+            }
+            if (cur_code == base_type::eoi_code()) {
+               return !segments.empty();
+            }
+            segments.push_back(clear_segment { in.tell(), 0, out_offset, 0 });
+            base_type::_codebook_size = base_type::eoi_code() + 1;
+            _prev_code = kInvalidCode;
+            continue;
+         }
+
+         // Data before the first clear code, or missing EOI, see decompress_codebook::decompress_single_code
+         if (segments.empty() || in.eof()) {
+            return false;
+         }
+
+         if (cur_code == base_type::_codebook_size) {
+            if (_prev_code >= base_type::_codebook_size) {
+               return false;
+            }
+            out_offset += length_of(_prev_code) + 1;
+            add_entry();
+         } else if (cur_code < base_type::_codebook_size) {
+            out_offset += length_of(cur_code);
+            if (_prev_code != kInvalidCode) {
+               add_entry();
+            }
+         } else {
+            return false;
+         }
+         _prev_code = cur_code;
+      }
+      return false;
+   }
+};
+
+// lzw_decompress_generic:
+//    Decompresses variable LZW data into _Out using _Codebook, which is either a decompress_codebook writing one index
+//    at a time through operator<<, or a string_table_codebook writing into an index_ostream. _In is a vbw_istream or a
+//    subblock_istream. codebook must be freshly allocated or reset.
+//    leading_clear is false when starting just after a clear code partway through a stream, which may have been wider
+//    than the initial code size.
+template <typename _Codebook, typename _In, typename _Out>
+decompress_status lzw_decompress_generic(_Codebook& codebook, _In& in, _Out& out, bool leading_clear = true) {
+   decompress_status status = leading_clear ? codebook.check_initial_clear_code(in, out) :
+                                              decompress_status::kSuccess;
    if (status != decompress_status::kSuccess) {
       return status;
    }
 
    while (!in.eof()) {
-      codebook->decompress_single_code(in, out);
+      status = codebook.decompress_single_code(in, out);
       if (status != decompress_status::kSuccess) {
          return status;
       }
    }
+   out.flush();
 
    return decompress_status::kSuccess;
 }
+
+// Calls f with a std::integral_constant holding bpp, so it can pick the per-bpp template. If bpp isn't 1 to 8, f isn't
+// called and invalid is returned instead.
+template <typename R, typename F>
+R dispatch_bpp(uint8_t bpp, R invalid, F&& f) {
+   switch (bpp) {
+      case 1:
+         return f(std::integral_constant<std::size_t, 1>());
+      case 2:
+         return f(std::integral_constant<std::size_t, 2>());
+      case 3:
+         return f(std::integral_constant<std::size_t, 3>());
+      case 4:
+         return f(std::integral_constant<std::size_t, 4>());
+      case 5:
+         return f(std::integral_constant<std::size_t, 5>());
+      case 6:
+         return f(std::integral_constant<std::size_t, 6>());
+      case 7:
+         return f(std::integral_constant<std::size_t, 7>());
+      case 8:
+         return f(std::integral_constant<std::size_t, 8>());
+   }
+   return invalid;
 }
 
+// One lazily allocated codebook per bpp, backing lzw_encoder and lzw_decoder
+template <template <std::size_t> typename _Codebook>
+class codebook_set {
+private:
+   std::tuple<std::unique_ptr<_Codebook<1>>, std::unique_ptr<_Codebook<2>>, std::unique_ptr<_Codebook<3>>,
+              std::unique_ptr<_Codebook<4>>, std::unique_ptr<_Codebook<5>>, std::unique_ptr<_Codebook<6>>,
+              std::unique_ptr<_Codebook<7>>, std::unique_ptr<_Codebook<8>>> _codebooks;
+
+public:
+   // Ready to start a new stream
+   template <std::size_t _Bits>
+   _Codebook<_Bits>& get() {
+      std::unique_ptr<_Codebook<_Bits>>& codebook = std::get<_Bits - 1>(_codebooks);
+      if (codebook) {
+         codebook->reset();
+      } else {
+         codebook = _Codebook<_Bits>::alloc_codebook();
+      }
+      return *codebook;
+   }
+};
+}
+
+struct lzw_encoder::codebooks {
+   codebook_set<compress_codebook> _trie;
+   codebook_set<hash_codebook> _hash;
+
+   template <std::size_t _Bits, typename _In, typename _Out>
+   void compress_with(_In& in, _Out& out, compress_method method, clear_policy policy, bool leading_clear,
+                      bool trailing_eoi) {
+      if (method == compress_method::kHashTable) {
+         lzw_compress_generic(_hash.get<_Bits>(), in, out, policy, leading_clear, trailing_eoi);
+      } else {
+         lzw_compress_generic(_trie.get<_Bits>(), in, out, policy, leading_clear, trailing_eoi);
+      }
+   }
+
+   template <typename _Out>
+   void compress(util::byte_span in, std::size_t nbits, uint8_t bpp, _Out& out, compress_method method,
+                 clear_policy policy) {
+      dispatch_bpp(bpp, false, [&] (auto bits) {
+            util::cbw_istream<decltype(bits)::value> in_stream(in, nbits);
+            compress_with<decltype(bits)::value>(in_stream, out, method, policy, true, true);
+            return true;
+         });
+   }
+
+   template <std::size_t _Bits, typename _Out>
+   void compress_lossy_with(util::index_istream& in, _Out& out, lossy_matcher& matcher, clear_policy policy) {
+      lossy_codebook<_Bits> codebook(_trie.get<_Bits>(), matcher);
+      lzw_compress_generic(codebook, in, out, policy);
+   }
+
+   template <typename _Out>
+   void compress_indices_lossy(util::byte_span in, uint8_t bpp, _Out& out, lossy_params const& lossy,
+                               clear_policy policy) {
+      util::index_istream in_stream(in);
+      lossy_matcher matcher(lossy);
+      dispatch_bpp(bpp, false, [&] (auto bits) {
+            compress_lossy_with<decltype(bits)::value>(in_stream, out, matcher, policy);
+            return true;
+         });
+   }
+
+   template <typename _Out>
+   void compress_indices(util::byte_span in, uint8_t bpp, _Out& out, compress_method method, clear_policy policy,
+                         bool leading_clear = true, bool trailing_eoi = true) {
+      util::index_istream in_stream(in);
+      dispatch_bpp(bpp, false, [&] (auto bits) {
+            compress_with<decltype(bits)::value>(in_stream, out, method, policy, leading_clear, trailing_eoi);
+            return true;
+         });
+   }
+};
+
+struct lzw_decoder::codebooks : public codebook_set<string_table_codebook> {};
 
 void lzw_compress_1bpp(util::cbw_istream<1>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<1>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_2bpp(util::cbw_istream<2>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<2>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_3bpp(util::cbw_istream<3>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<3>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_4bpp(util::cbw_istream<4>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<4>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_5bpp(util::cbw_istream<5>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<5>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_6bpp(util::cbw_istream<6>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<6>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_7bpp(util::cbw_istream<7>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
+   lzw_compress_generic(*compress_codebook<7>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
 }
 
 void lzw_compress_8bpp(util::cbw_istream<8>& in, util::vbw_ostream& out) {
-   lzw_compress_generic(in, out);
-}
-
-void lzw_compress(std::vector<uint8_t> const& in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out) {
-   if (bpp == 1) {
-      util::cbw_istream<1> in_stream(in, nbits);
-      lzw_compress_1bpp(in_stream, out);
-   } else if (bpp == 2) {
-      util::cbw_istream<2> in_stream(in, nbits);
-      lzw_compress_2bpp(in_stream, out);
-   } else if (bpp == 3) {
-      util::cbw_istream<3> in_stream(in, nbits);
-      lzw_compress_3bpp(in_stream, out);
-   } else if (bpp == 4) {
-      util::cbw_istream<4> in_stream(in, nbits);
-      lzw_compress_4bpp(in_stream, out);
-   } else if (bpp == 5) {
-      util::cbw_istream<5> in_stream(in, nbits);
-      lzw_compress_5bpp(in_stream, out);
-   } else if (bpp == 6) {
-      util::cbw_istream<6> in_stream(in, nbits);
-      lzw_compress_6bpp(in_stream, out);
-   } else if (bpp == 7) {
-      util::cbw_istream<7> in_stream(in, nbits);
-      lzw_compress_7bpp(in_stream, out);
-   } else if (bpp == 8) {
-      util::cbw_istream<8> in_stream(in, nbits);
-      lzw_compress_8bpp(in_stream, out);
-   }
-}
-
-void lzw_compress(std::vector<uint8_t> const& in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out) {
+   lzw_compress_generic(*compress_codebook<8>::alloc_codebook(), in, out, clear_policy::kClearAtFull);
+}
+
+lzw_encoder::lzw_encoder() : _codebooks(std::make_unique<codebooks>()) {}
+lzw_encoder::lzw_encoder(lzw_encoder&& rhs) = default;
+lzw_encoder& lzw_encoder::operator=(lzw_encoder&& rhs) = default;
+lzw_encoder::~lzw_encoder() = default;
+
+void lzw_encoder::compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out,
+                           compress_method method, clear_policy policy) {
+   _codebooks->compress(in, nbits, bpp, out, method, policy);
+}
+
+void lzw_encoder::compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::subblock_ostream& out,
+                           compress_method method, clear_policy policy) {
+   _codebooks->compress(in, nbits, bpp, out, method, policy);
+}
+
+void lzw_encoder::compress(util::byte_span in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out,
+                           compress_method method, clear_policy policy) {
+   util::vbw_ostream stream_out(out);
+   compress(in, nbits, bpp, stream_out, method, policy);
+}
+
+lzw_encode_result lzw_encoder::compress(util::byte_span in, std::size_t nbits, uint8_t bpp,
+                                        util::mutable_byte_span out, compress_method method, clear_policy policy) {
+   util::vbw_ostream stream_out(out);
+   compress(in, nbits, bpp, stream_out, method, policy);
+   return lzw_encode_result { stream_out.size(), stream_out.overflowed() };
+}
+
+void lzw_encoder::compress_indices(util::byte_span in, uint8_t bpp, util::vbw_ostream& out, compress_method method,
+                                   clear_policy policy) {
+   _codebooks->compress_indices(in, bpp, out, method, policy);
+}
+
+void lzw_encoder::compress_indices(util::byte_span in, uint8_t bpp, util::subblock_ostream& out,
+                                   compress_method method, clear_policy policy) {
+   _codebooks->compress_indices(in, bpp, out, method, policy);
+}
+
+void lzw_encoder::compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy,
+                                         util::vbw_ostream& out, clear_policy policy) {
+   _codebooks->compress_indices_lossy(in, bpp, out, lossy, policy);
+}
+
+void lzw_encoder::compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy,
+                                         util::subblock_ostream& out, clear_policy policy) {
+   _codebooks->compress_indices_lossy(in, bpp, out, lossy, policy);
+}
+
+void lzw_encoder::compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy,
+                                         std::vector<uint8_t>& out, clear_policy policy) {
+   util::vbw_ostream stream_out(out);
+   compress_indices_lossy(in, bpp, lossy, stream_out, policy);
+}
+
+void lzw_encoder::compress_indices_segment(util::byte_span in, uint8_t bpp, util::vbw_ostream& out, bool first,
+                                           bool last, compress_method method, clear_policy policy) {
+   _codebooks->compress_indices(in, bpp, out, method, policy, first, last);
+}
+
+void lzw_encoder::compress_indices(util::byte_span in, uint8_t bpp, std::vector<uint8_t>& out,
+                                   compress_method method, clear_policy policy) {
+   util::vbw_ostream stream_out(out);
+   compress_indices(in, bpp, stream_out, method, policy);
+}
+
+lzw_encode_result lzw_encoder::compress_indices(util::byte_span in, uint8_t bpp, util::mutable_byte_span out,
+                                                compress_method method, clear_policy policy) {
    util::vbw_ostream stream_out(out);
-   lzw_compress(in, nbits, bpp, stream_out);
+   compress_indices(in, bpp, stream_out, method, policy);
+   return lzw_encode_result { stream_out.size(), stream_out.overflowed() };
+}
+
+void lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out,
+                  compress_method method, clear_policy policy) {
+   lzw_encoder().compress(in, nbits, bpp, out, method, policy);
+}
+
+void lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out,
+                  compress_method method, clear_policy policy) {
+   lzw_encoder().compress(in, nbits, bpp, out, method, policy);
+}
+
+lzw_encode_result lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::mutable_byte_span out,
+                               compress_method method, clear_policy policy) {
+   return lzw_encoder().compress(in, nbits, bpp, out, method, policy);
+}
+
+void lzw_compress_indices(util::byte_span in, uint8_t bpp, util::vbw_ostream& out, compress_method method,
+                          clear_policy policy) {
+   lzw_encoder().compress_indices(in, bpp, out, method, policy);
+}
+
+void lzw_compress_indices(util::byte_span in, uint8_t bpp, std::vector<uint8_t>& out, compress_method method,
+                          clear_policy policy) {
+   lzw_encoder().compress_indices(in, bpp, out, method, policy);
+}
+
+lzw_encode_result lzw_compress_indices(util::byte_span in, uint8_t bpp, util::mutable_byte_span out,
+                                       compress_method method, clear_policy policy) {
+   return lzw_encoder().compress_indices(in, bpp, out, method, policy);
+}
+
+void lzw_compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy, std::vector<uint8_t>& out,
+                                clear_policy policy) {
+   lzw_encoder().compress_indices_lossy(in, bpp, lossy, out, policy);
+}
+
+namespace {
+// Encoders are kept per thread, since pool workers outlive any one call
+lzw_encoder& thread_encoder() {
+   thread_local lzw_encoder encoder;
+   return encoder;
+}
+
+template <typename _Out>
+void lzw_compress_indices_parallel_to(util::thread_pool& pool, util::byte_span in, uint8_t bpp, _Out& out,
+                                      parallel_compress_params const& params) {
+   const std::size_t min_units = std::max<std::size_t>(params._min_segment_units, 1);
+   const std::size_t nsegments = std::max<std::size_t>(1, std::min(pool.size() + 1, in._size / min_units));
+   if (nsegments == 1) {
+      thread_encoder().compress_indices(in, bpp, out, params._method, params._clear_policy);
+      return;
+   }
+
+   std::vector<std::vector<uint8_t>> segments(nsegments);
+   std::vector<std::size_t> segment_bits(nsegments);
+   const std::size_t segment_units = in._size / nsegments;
+   pool.parallel_for(nsegments, [&] (std::size_t i) {
+         const std::size_t begin = i * segment_units;
+         const std::size_t end = (i == nsegments - 1) ? in._size : begin + segment_units;
+         segments[i].reserve(lzw_compress_bound(end - begin, bpp));
+         util::vbw_ostream segment_out(segments[i]);
+         thread_encoder().compress_indices_segment(util::byte_span(in._data + begin, end - begin), bpp, segment_out,
+                                                   i == 0, i == nsegments - 1, params._method,
+                                                   params._clear_policy);
+         segment_bits[i] = segment_out.size();
+      });
+
+   for (std::size_t i = 0; i < nsegments; i++) {
+      out.append(segments[i], segment_bits[i]);
+   }
+   out.flush();
+}
+}
+
+void lzw_compress_indices_parallel(util::thread_pool& pool, util::byte_span in, uint8_t bpp,
+                                   std::vector<uint8_t>& out, parallel_compress_params const& params) {
+   util::vbw_ostream stream_out(out);
+   lzw_compress_indices_parallel_to(pool, in, bpp, stream_out, params);
+}
+
+void lzw_compress_indices_parallel(util::thread_pool& pool, util::byte_span in, uint8_t bpp,
+                                   util::subblock_ostream& out, parallel_compress_params const& params) {
+   lzw_compress_indices_parallel_to(pool, in, bpp, out, params);
+}
+
+std::size_t lzw_compress_bound(std::size_t nunits, uint8_t bpp) {
+   // Every code covers at least one unit, on top of that there is the initial clear code, the EOI code, and a clear
+   // code each time the codebook fills up
+   const std::size_t codes_per_clear = (std::size_t{1} << kMaxCodeBits) - 1 - ((std::size_t{1} << bpp) + 2);
+   const std::size_t max_codes = nunits + (nunits / codes_per_clear) + 2;
+   return util::to_byte(max_codes * kMaxCodeBits + 7);
 }
 
 decompress_status lzw_decompress_1bpp(util::vbw_istream& in, util::cbw_ostream<1>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<1>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_2bpp(util::vbw_istream& in, util::cbw_ostream<2>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<2>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_3bpp(util::vbw_istream& in, util::cbw_ostream<3>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<3>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_4bpp(util::vbw_istream& in, util::cbw_ostream<4>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<4>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_5bpp(util::vbw_istream& in, util::cbw_ostream<5>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<5>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_6bpp(util::vbw_istream& in, util::cbw_ostream<6>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<6>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_7bpp(util::vbw_istream& in, util::cbw_ostream<7>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<7>::alloc_codebook(), in, out);
 }
 
 decompress_status lzw_decompress_8bpp(util::vbw_istream& in, util::cbw_ostream<8>& out) {
-   return lzw_decompress_generic(in, out);
+   return lzw_decompress_generic(*decompress_codebook<8>::alloc_codebook(), in, out);
 }
 
-lzw_decode_result lzw_decompress(util::vbw_istream& in, std::vector<uint8_t>& out, uint8_t bpp) {
+namespace {
+template <typename _Sink>
+lzw_decode_result lzw_decompress_into(util::vbw_istream& in, _Sink& out, uint8_t bpp) {
    lzw_decode_result result = {};
-   if (bpp == 1) {
-      util::cbw_ostream<1> stream_out(out);
-      result._status = lzw_decompress_1bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 2) {
-      util::cbw_ostream<2> stream_out(out);
-      result._status = lzw_decompress_2bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 3) {
-      util::cbw_ostream<3> stream_out(out);
-      result._status = lzw_decompress_3bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 4) {
-      util::cbw_ostream<4> stream_out(out);
-      result._status = lzw_decompress_4bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 5) {
-      util::cbw_ostream<5> stream_out(out);
-      result._status = lzw_decompress_5bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 6) {
-      util::cbw_ostream<6> stream_out(out);
-      result._status = lzw_decompress_6bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 7) {
-      util::cbw_ostream<7> stream_out(out);
-      result._status = lzw_decompress_7bpp(in, stream_out);
-      result._bits_written = stream_out.size();
-   } else if (bpp == 8) {
-      util::cbw_ostream<8> stream_out(out);
-      result._status = lzw_decompress_8bpp(in, stream_out);
-      result._bits_written = stream_out.size();
+   bool overflow = false;
+   result._status = dispatch_bpp(bpp, decompress_status::kInvalidCodeSize, [&] (auto bits) {
+         util::cbw_ostream<decltype(bits)::value> stream_out(out);
+         decompress_status status = lzw_decompress(in, stream_out);
+         result._bits_written = stream_out.size();
+         overflow = stream_out.overflowed();
+         return status;
+      });
+   if (result._status == decompress_status::kSuccess && overflow) {
+      result._status = decompress_status::kOutputOverflow;
    }
    return result;
 }
+}
 
-lzw_decode_result lzw_decompress(std::vector<uint8_t> const& in, std::vector<uint8_t>& out, uint8_t bpp) {
-   util::vbw_istream stream_in(in, util::to_bit(in.size()));
+lzw_decode_result lzw_decompress(util::vbw_istream& in, std::vector<uint8_t>& out, uint8_t bpp) {
+   return lzw_decompress_into(in, out, bpp);
+}
+
+lzw_decode_result lzw_decompress(util::vbw_istream& in, util::mutable_byte_span out, uint8_t bpp) {
+   return lzw_decompress_into(in, out, bpp);
+}
+
+lzw_decode_result lzw_decompress(util::byte_span in, std::vector<uint8_t>& out, uint8_t bpp) {
+   util::vbw_istream stream_in(in, util::to_bit(in._size));
    return lzw_decompress(stream_in, out, bpp);
 }
 
+lzw_decode_result lzw_decompress(util::byte_span in, util::mutable_byte_span out, uint8_t bpp) {
+   util::vbw_istream stream_in(in, util::to_bit(in._size));
+   return lzw_decompress(stream_in, out, bpp);
+}
+
+namespace {
+template <typename _In, typename _Out>
+decompress_status lzw_decompress_indices_to(codebook_set<string_table_codebook>& codebooks, _In& in, _Out& out,
+                                            uint8_t bpp, bool leading_clear) {
+   return dispatch_bpp(bpp, decompress_status::kInvalidCodeSize, [&] (auto bits) {
+         return lzw_decompress_generic(codebooks.get<decltype(bits)::value>(), in, out, leading_clear);
+      });
+}
+
+template <typename _In, typename _Out>
+lzw_decode_result lzw_decompress_indices_from(codebook_set<string_table_codebook>& codebooks, _In& in, _Out& out,
+                                              uint8_t bpp, bool leading_clear = true) {
+   lzw_decode_result result = {};
+   result._status = lzw_decompress_indices_to(codebooks, in, out, bpp, leading_clear);
+   result._bits_written = out.size();
+   if (result._status == decompress_status::kSuccess && out.overflowed()) {
+      result._status = decompress_status::kOutputOverflow;
+   }
+   return result;
+}
+}
+
+lzw_decoder::lzw_decoder() : _codebooks(std::make_unique<codebooks>()) {}
+lzw_decoder::lzw_decoder(lzw_decoder&& rhs) = default;
+lzw_decoder& lzw_decoder::operator=(lzw_decoder&& rhs) = default;
+lzw_decoder::~lzw_decoder() = default;
+
+template <typename _In, typename _Out, if_stream_source<_In>>
+lzw_decode_result lzw_decoder::decompress_indices(_In& in, _Out& out, uint8_t bpp) {
+   return lzw_decompress_indices_from(*_codebooks, in, out, bpp);
+}
+
+template lzw_decode_result lzw_decoder::decompress_indices(util::vbw_istream& in, util::index_ostream& out,
+                                                           uint8_t bpp);
+template lzw_decode_result lzw_decoder::decompress_indices(util::subblock_istream<util::span_block_source>& in,
+                                                           util::index_ostream& out, uint8_t bpp);
+template lzw_decode_result lzw_decoder::decompress_indices(util::subblock_istream<util::span_block_source>& in,
+                                                           quant::canvas_ostream& out, uint8_t bpp);
+
+lzw_decode_result lzw_decoder::decompress_indices(util::byte_span in, util::mutable_byte_span out, uint8_t bpp) {
+   util::vbw_istream stream_in(in, util::to_bit(in._size));
+   return decompress_indices(stream_in, out, bpp);
+}
+
+lzw_decode_result lzw_decoder::decompress_indices_segment(util::vbw_istream& in, util::mutable_byte_span out,
+                                                          uint8_t bpp) {
+   util::index_ostream stream_out(out);
+   return lzw_decompress_indices_from(*_codebooks, in, stream_out, bpp, false);
+}
+
+lzw_decode_result lzw_decompress_indices(util::byte_span in, util::mutable_byte_span out, uint8_t bpp) {
+   return lzw_decoder().decompress_indices(in, out, bpp);
+}
+
+namespace {
+lzw_decoder& thread_decoder() {
+   thread_local lzw_decoder decoder;
+   return decoder;
+}
+
+bool scan_clear_codes(util::vbw_istream& in, uint8_t bpp, std::vector<clear_segment>& segments) {
+   return dispatch_bpp(bpp, false, [&] (auto bits) {
+         return clear_code_scanner<decltype(bits)::value>().scan(in, segments);
+      });
+}
+}
+
+lzw_decode_result lzw_decompress_indices_parallel(util::thread_pool& pool, util::byte_span in,
+                                                  util::mutable_byte_span out, uint8_t bpp,
+                                                  parallel_decompress_params const& params) {
+   const std::size_t min_units = std::max<std::size_t>(params._min_segment_units, 1);
+   const std::size_t max_chunks = std::min(pool.size() + 1, out._size / min_units);
+
+   std::vector<clear_segment> segments;
+   if (max_chunks > 1) {
+      util::vbw_istream scan_in(in, util::to_bit(in._size));
+      if (!scan_clear_codes(scan_in, bpp, segments)) {
+         segments.clear();
+      }
+   }
+   // Anything the scan can't split up, including bad data, is left to the regular decoder to deal with
+   if (segments.size() < 2) {
+      return thread_decoder().decompress_indices(in, out, bpp);
+   }
+
+   // Group the segments into runs of roughly even output, each decoded on its own thread
+   const std::size_t total_out = segments.back()._out_offset + segments.back()._out_length;
+   std::vector<std::pair<std::size_t, std::size_t>> chunks;
+   std::size_t chunk_begin = 0;
+   for (std::size_t i = 0; i < segments.size(); i++) {
+      const std::size_t chunk_out = segments[i]._out_offset + segments[i]._out_length -
+                                    segments[chunk_begin]._out_offset;
+      if (chunk_out * max_chunks >= total_out || i == segments.size() - 1) {
+         chunks.emplace_back(chunk_begin, i + 1);
+         chunk_begin = i + 1;
+      }
+   }
+
+   std::vector<decompress_status> statuses(chunks.size(), decompress_status::kSuccess);
+   pool.parallel_for(chunks.size(), [&] (std::size_t i) {
+         clear_segment const& first = segments[chunks[i].first];
+         clear_segment const& last = segments[chunks[i].second - 1];
+         const std::size_t out_begin = std::min(first._out_offset, out._size);
+         const std::size_t out_end = std::min(last._out_offset + last._out_length, out._size);
+
+         util::vbw_istream chunk_in(in, last._end_bit);
+         chunk_in.seek(first._start_bit);
+         statuses[i] = thread_decoder().decompress_indices_segment(
+               chunk_in, util::mutable_byte_span(out._data + out_begin, out_end - out_begin), bpp)._status;
+      });
+
+   lzw_decode_result result = { util::to_bit(std::min(total_out, out._size)), decompress_status::kSuccess };
+   for (decompress_status status : statuses) {
+      if (status != decompress_status::kSuccess && status != decompress_status::kOutputOverflow) {
+         result._status = status;
+         return result;
+      }
+   }
+   if (total_out > out._size) {
+      result._status = decompress_status::kOutputOverflow;
+   }
+   return result;
+}
+
 }
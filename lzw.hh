@@ -1,10 +1,16 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
 #include <vector>
 
 #include "bitfield.hh"
 #include "bitstream.hh"
+#include "gif_spec.hh"
+#include "subblock.hh"
+#include "thread_pool.hh"
 
 namespace gifproc::lzw {
 
@@ -38,8 +44,162 @@ void lzw_compress(util::cbw_istream<_Bits>& in, util::vbw_ostream& out) {
    }
 }
 
-void lzw_compress(std::vector<uint8_t> const& in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out);
-void lzw_compress(std::vector<uint8_t> const& in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out);
+struct lzw_encode_result {
+   std::size_t _bits_written;
+   // The output didn't fit into the fixed size buffer given, and was truncated
+   bool _overflow;
+};
+
+// How the compressor stores its dictionary, the output is the same either way
+enum class compress_method {
+   // A trie with a connection for every possible unit on each entry, 2MB at 8bpp
+   kTrie,
+   // An open-addressed hash table of (prefix code, unit) pairs, 32KB at any bpp
+   kHashTable,
+};
+
+// When the compressor clears its dictionary. A cleared dictionary adapts to the data that follows it, but has to be
+// built up again from single units. Any of these decode with a conforming decoder.
+enum class clear_policy {
+   // Clear as soon as the dictionary fills up, like most encoders do
+   kClearAtFull,
+   // Keep using the full dictionary until the end of the image, which does best on uniform content
+   kDeferred,
+   // Keep the full dictionary while it compresses as well as it did while it was being built, clearing once it falls
+   // behind, which does best when content changes partway through the image
+   kRatioMonitored,
+};
+
+// These use a temporary lzw_encoder
+void lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out,
+                  compress_method method = compress_method::kTrie,
+                  clear_policy policy = clear_policy::kClearAtFull);
+void lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out,
+                  compress_method method = compress_method::kTrie,
+                  clear_policy policy = clear_policy::kClearAtFull);
+lzw_encode_result lzw_compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::mutable_byte_span out,
+                               compress_method method = compress_method::kTrie,
+                               clear_policy policy = clear_policy::kClearAtFull);
+
+// Compresses indices stored one per byte, as the quantizer produces, instead of packed at bpp bits. Every index must be
+// below 1 << bpp. The output is the same as lzw_compress on the packed indices.
+void lzw_compress_indices(util::byte_span in, uint8_t bpp, util::vbw_ostream& out,
+                          compress_method method = compress_method::kTrie,
+                          clear_policy policy = clear_policy::kClearAtFull);
+void lzw_compress_indices(util::byte_span in, uint8_t bpp, std::vector<uint8_t>& out,
+                          compress_method method = compress_method::kTrie,
+                          clear_policy policy = clear_policy::kClearAtFull);
+lzw_encode_result lzw_compress_indices(util::byte_span in, uint8_t bpp, util::mutable_byte_span out,
+                                       compress_method method = compress_method::kTrie,
+                                       clear_policy policy = clear_policy::kClearAtFull);
+
+// Lets the compressor extend a dictionary match with a pixel of a similar color when the pixel actually there would end
+// it, like gifsicle's --lossy. The error from each swap is carried on to the following pixels, half of it at a time, so
+// runs of swaps don't drift away from the image.
+struct lossy_params {
+   lossy_params(std::vector<color_table_entry> const& palette, uint32_t max_distance,
+                std::optional<uint8_t> transparent_index = std::nullopt)
+         : _palette(palette),
+           _max_distance(max_distance),
+           _transparent_index(transparent_index) {}
+
+   // Color of each index, indices past the end are black
+   std::vector<color_table_entry> const& _palette;
+   // Furthest in RGB space a swapped in color may be from the pixel's own color plus the error carried to it. 0 only
+   // matches exactly, the same as lossless.
+   uint32_t _max_distance;
+   // Never swapped in or out, so transparency is kept exactly
+   std::optional<uint8_t> _transparent_index;
+};
+
+// Lossy variant of lzw_compress_indices, see lossy_params. Uses a temporary lzw_encoder.
+void lzw_compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy, std::vector<uint8_t>& out,
+                                clear_policy policy = clear_policy::kClearAtFull);
+
+// Holds the codebooks used by lzw_compress so they can be reused from one frame to the next. A codebook is allocated
+// the first time its bpp and compress_method are used and only reset after that. A bpp outside 1 to 8 writes nothing.
+// Not thread safe, each thread should have its own.
+class lzw_encoder {
+private:
+   struct codebooks;
+   std::unique_ptr<codebooks> _codebooks;
+
+public:
+   lzw_encoder();
+   lzw_encoder(lzw_encoder&& rhs);
+   lzw_encoder& operator=(lzw_encoder&& rhs);
+   ~lzw_encoder();
+
+   void compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::vbw_ostream& out,
+                 compress_method method = compress_method::kTrie,
+                 clear_policy policy = clear_policy::kClearAtFull);
+   // Writes the image data exactly as it goes in the file, framed into sub-blocks and ending with the terminator
+   void compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::subblock_ostream& out,
+                 compress_method method = compress_method::kTrie,
+                 clear_policy policy = clear_policy::kClearAtFull);
+   void compress(util::byte_span in, std::size_t nbits, uint8_t bpp, std::vector<uint8_t>& out,
+                 compress_method method = compress_method::kTrie,
+                 clear_policy policy = clear_policy::kClearAtFull);
+   lzw_encode_result compress(util::byte_span in, std::size_t nbits, uint8_t bpp, util::mutable_byte_span out,
+                              compress_method method = compress_method::kTrie,
+                              clear_policy policy = clear_policy::kClearAtFull);
+
+   void compress_indices(util::byte_span in, uint8_t bpp, util::vbw_ostream& out,
+                         compress_method method = compress_method::kTrie,
+                         clear_policy policy = clear_policy::kClearAtFull);
+   void compress_indices(util::byte_span in, uint8_t bpp, util::subblock_ostream& out,
+                         compress_method method = compress_method::kTrie,
+                         clear_policy policy = clear_policy::kClearAtFull);
+   void compress_indices(util::byte_span in, uint8_t bpp, std::vector<uint8_t>& out,
+                         compress_method method = compress_method::kTrie,
+                         clear_policy policy = clear_policy::kClearAtFull);
+   lzw_encode_result compress_indices(util::byte_span in, uint8_t bpp, util::mutable_byte_span out,
+                                      compress_method method = compress_method::kTrie,
+                                      clear_policy policy = clear_policy::kClearAtFull);
+
+   // Lossy variants of compress_indices, see lossy_params. These always use compress_method::kTrie, the hash table
+   // can't list the entries following a match to find a similar one.
+   void compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy, util::vbw_ostream& out,
+                               clear_policy policy = clear_policy::kClearAtFull);
+   void compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy,
+                               util::subblock_ostream& out, clear_policy policy = clear_policy::kClearAtFull);
+   void compress_indices_lossy(util::byte_span in, uint8_t bpp, lossy_params const& lossy,
+                               std::vector<uint8_t>& out, clear_policy policy = clear_policy::kClearAtFull);
+
+   // Compresses one segment of a stream split up by lzw_compress_indices_parallel. The first segment starts with a
+   // clear code, and every segment but the last ends with a clear code in place of EOI, so the segments' bits can be
+   // concatenated into one stream.
+   void compress_indices_segment(util::byte_span in, uint8_t bpp, util::vbw_ostream& out, bool first, bool last,
+                                 compress_method method = compress_method::kTrie,
+                                 clear_policy policy = clear_policy::kClearAtFull);
+};
+
+struct parallel_compress_params {
+   constexpr parallel_compress_params(std::size_t min_segment_units = std::size_t{1} << 20,
+                                      compress_method method = compress_method::kTrie,
+                                      clear_policy policy = clear_policy::kClearAtFull)
+         : _min_segment_units(min_segment_units),
+           _method(method),
+           _clear_policy(policy) {}
+
+   // Segments are never split smaller than this, so smaller images are compressed on one thread
+   std::size_t _min_segment_units;
+   compress_method _method;
+   clear_policy _clear_policy;
+};
+
+// Same output format as lzw_compress_indices, but splits the indices into segments compressed in parallel across pool.
+// Each segment starts from a cleared dictionary, so the output is a little larger than compressing in one go.
+// Uses one lzw_encoder per thread.
+void lzw_compress_indices_parallel(util::thread_pool& pool, util::byte_span in, uint8_t bpp,
+                                   std::vector<uint8_t>& out,
+                                   parallel_compress_params const& params = parallel_compress_params());
+void lzw_compress_indices_parallel(util::thread_pool& pool, util::byte_span in, uint8_t bpp,
+                                   util::subblock_ostream& out,
+                                   parallel_compress_params const& params = parallel_compress_params());
+
+// Upper bound on the number of bytes lzw_compress can produce for nunits units of bpp bits, for reserving output space
+std::size_t lzw_compress_bound(std::size_t nunits, uint8_t bpp);
 
 // zero: Success, non-zero: Failure
 enum class decompress_status {
@@ -56,6 +216,12 @@ enum class decompress_status {
 
    // If a compression code is read that shouldn't be written out by a valid lzw compressor
    kInvalidCompressCode,
+
+   // Decompressed data didn't fit into the fixed size output buffer, and was truncated
+   kOutputOverflow,
+
+   // bpp was outside 1 to 8, so there was no decoder to run
+   kInvalidCodeSize,
 };
 
 decompress_status lzw_decompress_1bpp(util::vbw_istream& in, util::cbw_ostream<1>& out);
@@ -94,6 +260,73 @@ struct lzw_decode_result {
 };
 
 lzw_decode_result lzw_decompress(util::vbw_istream& in, std::vector<uint8_t>& out, uint8_t bpp);
-lzw_decode_result lzw_decompress(std::vector<uint8_t> const& in, std::vector<uint8_t>& out, uint8_t bpp);
+lzw_decode_result lzw_decompress(util::vbw_istream& in, util::mutable_byte_span out, uint8_t bpp);
+lzw_decode_result lzw_decompress(util::byte_span in, std::vector<uint8_t>& out, uint8_t bpp);
+lzw_decode_result lzw_decompress(util::byte_span in, util::mutable_byte_span out, uint8_t bpp);
+
+// Sources read through as a stream. Anything convertible to a byte_span takes the byte_span overloads instead.
+template <typename _In>
+using if_stream_source = std::enable_if_t<!std::is_convertible_v<_In&, util::byte_span>, int>;
+
+struct parallel_decompress_params {
+   constexpr parallel_decompress_params(std::size_t min_segment_units = std::size_t{1} << 20)
+         : _min_segment_units(min_segment_units) {}
+
+   // Each thread decodes at least this many indices, so smaller images are decoded on one thread
+   std::size_t _min_segment_units;
+};
+
+// Same as lzw_decompress_indices, but first scans in for its clear codes, which only needs code widths and lengths and
+// not the dictionary. Runs of codes between clears are then decoded in parallel across pool straight into their place
+// in out. Streams without enough clear codes to split are decoded on the calling thread. Uses one lzw_decoder per
+// thread.
+lzw_decode_result lzw_decompress_indices_parallel(util::thread_pool& pool, util::byte_span in,
+                                                  util::mutable_byte_span out, uint8_t bpp,
+                                                  parallel_decompress_params const& params =
+                                                        parallel_decompress_params());
+
+// Holds the codebooks used by lzw_decompress_indices so they can be reused from one frame to the next, the same as
+// lzw_encoder. Not thread safe, each thread should have its own.
+class lzw_decoder {
+private:
+   struct codebooks;
+   std::unique_ptr<codebooks> _codebooks;
+
+public:
+   lzw_decoder();
+   lzw_decoder(lzw_decoder&& rhs);
+   lzw_decoder& operator=(lzw_decoder&& rhs);
+   ~lzw_decoder();
+
+   // Decompresses into one byte per index instead of packing indices at bpp bits. _bits_written counts 8 bits per
+   // index written.
+   // in is a vbw_istream or a subblock_istream, and out an index_ostream or a sink with the same interface, such as
+   // quant::canvas_ostream drawing straight onto a frame's canvas (canvas_ostream::finish must still be called). The
+   // combinations used are explicitly instantiated in lzw.cc.
+   template <typename _In, typename _Out, if_stream_source<_In> = 0>
+   lzw_decode_result decompress_indices(_In& in, _Out& out, uint8_t bpp);
+
+   // out should be sized to the number of pixels in the image
+   template <typename _In, if_stream_source<_In> = 0>
+   lzw_decode_result decompress_indices(_In& in, util::mutable_byte_span out, uint8_t bpp) {
+      util::index_ostream stream_out(out);
+      return decompress_indices(in, stream_out, bpp);
+   }
+   lzw_decode_result decompress_indices(util::byte_span in, util::mutable_byte_span out, uint8_t bpp);
+
+   // Decodes part of a stream starting just after one of its clear codes, see lzw_decompress_indices_parallel
+   lzw_decode_result decompress_indices_segment(util::vbw_istream& in, util::mutable_byte_span out, uint8_t bpp);
+};
+
+// Same as lzw_decoder::decompress_indices, using a temporary lzw_decoder
+template <typename _In, typename _Out, if_stream_source<_In> = 0>
+lzw_decode_result lzw_decompress_indices(_In& in, _Out& out, uint8_t bpp) {
+   return lzw_decoder().decompress_indices(in, out, bpp);
+}
+template <typename _In, if_stream_source<_In> = 0>
+lzw_decode_result lzw_decompress_indices(_In& in, util::mutable_byte_span out, uint8_t bpp) {
+   return lzw_decoder().decompress_indices(in, out, bpp);
+}
+lzw_decode_result lzw_decompress_indices(util::byte_span in, util::mutable_byte_span out, uint8_t bpp);
 
 }
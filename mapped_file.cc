@@ -0,0 +1,153 @@
+#include "mapped_file.hh"
+
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace gifproc::util {
+
+#ifdef _WIN32
+mapped_file::mapped_file()
+      : _data(nullptr), _size(0), _open(false), _file_handle(nullptr), _mapping_handle(nullptr) {}
+
+mapped_file::mapped_file(mapped_file&& rhs)
+      : _data(std::exchange(rhs._data, nullptr)),
+        _size(std::exchange(rhs._size, 0)),
+        _open(std::exchange(rhs._open, false)),
+        _file_handle(std::exchange(rhs._file_handle, nullptr)),
+        _mapping_handle(std::exchange(rhs._mapping_handle, nullptr)) {}
+
+mapped_file& mapped_file::operator=(mapped_file&& rhs) {
+   if (this != &rhs) {
+      close();
+      _data = std::exchange(rhs._data, nullptr);
+      _size = std::exchange(rhs._size, 0);
+      _open = std::exchange(rhs._open, false);
+      _file_handle = std::exchange(rhs._file_handle, nullptr);
+      _mapping_handle = std::exchange(rhs._mapping_handle, nullptr);
+   }
+   return *this;
+}
+
+bool mapped_file::open(std::string_view path) {
+   close();
+   HANDLE file = CreateFileA(std::string(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+   if (file == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+   LARGE_INTEGER file_size;
+   if (!GetFileSizeEx(file, &file_size)) {
+      CloseHandle(file);
+      return false;
+   }
+   _file_handle = file;
+   _open = true;
+   // Empty files can't be mapped
+   if (file_size.QuadPart == 0) {
+      return true;
+   }
+
+   HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+   if (mapping == nullptr) {
+      close();
+      return false;
+   }
+   _mapping_handle = mapping;
+   void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   if (view == nullptr) {
+      close();
+      return false;
+   }
+   _data = static_cast<uint8_t const*>(view);
+   _size = static_cast<std::size_t>(file_size.QuadPart);
+   return true;
+}
+
+void mapped_file::close() {
+   if (_data != nullptr) {
+      UnmapViewOfFile(_data);
+   }
+   if (_mapping_handle != nullptr) {
+      CloseHandle(_mapping_handle);
+   }
+   if (_file_handle != nullptr) {
+      CloseHandle(_file_handle);
+   }
+   _data = nullptr;
+   _size = 0;
+   _open = false;
+   _file_handle = nullptr;
+   _mapping_handle = nullptr;
+}
+#else
+mapped_file::mapped_file() : _data(nullptr), _size(0), _open(false) {}
+
+mapped_file::mapped_file(mapped_file&& rhs)
+      : _data(std::exchange(rhs._data, nullptr)),
+        _size(std::exchange(rhs._size, 0)),
+        _open(std::exchange(rhs._open, false)) {}
+
+mapped_file& mapped_file::operator=(mapped_file&& rhs) {
+   if (this != &rhs) {
+      close();
+      _data = std::exchange(rhs._data, nullptr);
+      _size = std::exchange(rhs._size, 0);
+      _open = std::exchange(rhs._open, false);
+   }
+   return *this;
+}
+
+bool mapped_file::open(std::string_view path) {
+   close();
+   const int fd = ::open(std::string(path).c_str(), O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+   struct stat file_stat;
+   if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      ::close(fd);
+      return false;
+   }
+   const std::size_t file_size = static_cast<std::size_t>(file_stat.st_size);
+   // Empty files can't be mapped
+   if (file_size > 0) {
+      void* view = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (view == MAP_FAILED) {
+         ::close(fd);
+         return false;
+      }
+      // The file is read front to back while parsing, and then again a frame at a time while decoding
+      madvise(view, file_size, MADV_SEQUENTIAL);
+      _data = static_cast<uint8_t const*>(view);
+      _size = file_size;
+   }
+   // The mapping stays valid without the descriptor
+   ::close(fd);
+   _open = true;
+   return true;
+}
+
+void mapped_file::close() {
+   if (_data != nullptr) {
+      munmap(const_cast<uint8_t*>(_data), _size);
+   }
+   _data = nullptr;
+   _size = 0;
+   _open = false;
+}
+#endif
+
+mapped_file::~mapped_file() {
+   close();
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "bitstream.hh"
+
+namespace gifproc::util {
+
+// Read-only memory mapping of a whole file, unmapped when this is destroyed or another file is opened
+class mapped_file {
+private:
+   uint8_t const* _data;
+   std::size_t _size;
+   bool _open;
+#ifdef _WIN32
+   void* _file_handle;
+   void* _mapping_handle;
+#endif
+
+public:
+   mapped_file();
+   mapped_file(mapped_file&& rhs);
+   mapped_file& operator=(mapped_file&& rhs);
+   ~mapped_file();
+
+   mapped_file(mapped_file const&) = delete;
+   mapped_file& operator=(mapped_file const&) = delete;
+
+   // False if the file couldn't be opened or mapped. An empty file opens with an empty span.
+   bool open(std::string_view path);
+   void close();
+
+   constexpr bool is_open() const {
+      return _open;
+   }
+
+   // Valid until this is closed, and kept valid across moves
+   constexpr byte_span data() const {
+      return byte_span(_data, _size);
+   }
+};
+
+}
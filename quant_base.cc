@@ -1,5 +1,7 @@
 #include "quant_base.hh"
 
+#include <algorithm>
+
 namespace gifproc::quant {
 
 gif_frame::gif_frame(gif_frame&& rhs)
@@ -31,9 +33,16 @@ gif_frame& gif_frame::operator=(gif_frame&& rhs) {
 }
 
 void gif_frame::clear_region(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
-   for (uint32_t i = 0; i < h; i++) {
-      const std::size_t row_start = ((i + y) * _w) + x;
-      const std::size_t row_end = row_start + w;
+   // A frame's descriptor can put its region partly or wholly off the canvas, only the part on it is cleared, the same
+   // as canvas_ostream only draws that part
+   const std::size_t x_end = std::min<std::size_t>(std::size_t{x} + w, _w);
+   const std::size_t y_end = std::min<std::size_t>(std::size_t{y} + h, _h);
+   if (x >= x_end) {
+      return;
+   }
+   for (std::size_t i = y; i < y_end; i++) {
+      const std::size_t row_start = (i * _w) + x;
+      const std::size_t row_end = (i * _w) + x_end;
 
       std::fill(_img.begin() + row_start, _img.begin() + row_end, pixel());
    }
@@ -0,0 +1,56 @@
+#include "subblock.hh"
+
+namespace gifproc::util {
+
+span_block_source::span_block_source(byte_span source, std::size_t pos)
+      : _in(source, pos), _done(false), _truncated(false) {}
+
+byte_span span_block_source::next() {
+   if (_done) {
+      return byte_span();
+   }
+
+   uint8_t block_len;
+   if (!_in.read(&block_len)) {
+      _done = _truncated = true;
+      return byte_span();
+   }
+   if (block_len == 0) {
+      _done = true;
+      return byte_span();
+   }
+
+   byte_span block;
+   if (!_in.read_span(block_len, block)) {
+      // Hand back whatever is left of the truncated block
+      _in.read_span(_in.remaining(), block);
+      _done = _truncated = true;
+   }
+   return block;
+}
+
+void gather_subblocks(byte_span source, std::size_t start, subblock_index const& index, uint8_t* out) {
+   assert(start + index.framed_size() <= source._size);
+   uint8_t const* block = source._data + start;
+   if (index._uniform) {
+      // Full blocks are a fixed stride apart, so there are no length bytes to read before the last one
+      const std::size_t nfull = index._nblocks > 0 ? index._nblocks - 1 : 0;
+      for (std::size_t i = 0; i < nfull; i++) {
+         memcpy(out, block + 1, kMaxSubblockSize);
+         block += kMaxSubblockSize + 1;
+         out += kMaxSubblockSize;
+      }
+      if (index._nblocks > 0) {
+         memcpy(out, block + 1, index._payload_size - nfull * kMaxSubblockSize);
+      }
+      return;
+   }
+   for (std::size_t i = 0; i < index._nblocks; i++) {
+      const std::size_t block_len = block[0];
+      memcpy(out, block + 1, block_len);
+      block += block_len + 1;
+      out += block_len;
+   }
+}
+
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "bitfield.hh"
+#include "bitstream.hh"
+#include "gif_spec.hh"
+
+namespace gifproc::util {
+
+// Reads the data sub-blocks following a frame's image descriptor out of a buffer holding the whole file, such as a
+// mapped_file. Payloads point into the buffer rather than being copied out of it.
+class span_block_source {
+private:
+   byte_reader _in;
+   bool _done;
+   bool _truncated;
+
+public:
+   // Starts at offset pos in source, which should be just after the frame's LZW minimum code size
+   span_block_source(byte_span source, std::size_t pos);
+   span_block_source(span_block_source&&) = delete;
+
+   // Payload of the next sub-block, or an empty span once the block terminator has been read
+   byte_span next();
+
+   // The buffer ended before the block terminator
+   constexpr bool truncated() const {
+      return _truncated;
+   }
+};
+
+// Layout of a run of data sub-blocks, recorded while they are first skipped over so they can later be gathered without
+// reading their length bytes again
+struct subblock_index {
+   // Total size of the payloads, not counting length bytes or the block terminator
+   std::size_t _payload_size;
+   std::size_t _nblocks;
+   // Every block but the last holds kMaxSubblockSize bytes, as written by every encoder in practice, so block i's
+   // payload is at a fixed stride from the first
+   bool _uniform;
+
+   constexpr subblock_index() : _payload_size(0), _nblocks(0), _uniform(true) {}
+
+   // Adds a block with a payload of len bytes to the end of the run
+   constexpr void add_block(std::size_t len) {
+      // Only a full block can have another after it
+      _uniform = _uniform && (_nblocks == 0 || _payload_size == _nblocks * kMaxSubblockSize);
+      _payload_size += len;
+      _nblocks++;
+   }
+
+   // Size of the sub-blocks in the file, including length bytes and the block terminator
+   constexpr std::size_t framed_size() const {
+      return _payload_size + _nblocks + 1;
+   }
+};
+
+// Copies the payloads of the sub-blocks starting at offset start in source into out, which must hold at least
+// index._payload_size bytes. The blocks must have been checked to lie within source when index was built.
+void gather_subblocks(byte_span source, std::size_t start, subblock_index const& index, uint8_t* out);
+
+// The payload of a run made of a single sub-block, which can be used in place rather than gathered
+inline byte_span single_subblock(byte_span source, std::size_t start, subblock_index const& index) {
+   assert(index._nblocks == 1);
+   return byte_span(source._data + start + 1, index._payload_size);
+}
+
+// Variable-bitwidth istream over the payloads of a series of GIF data sub-blocks, which skips the block length bytes
+// as it goes rather than needing the data gathered into one buffer first. Blocks are pulled from _Source only once
+// the bits before them have been consumed, so decoding can start before the rest of the data has been read.
+// Matches the parts of the vbw_istream interface used by the LZW decompressors.
+template <typename _Source>
+class subblock_istream {
+private:
+   constexpr static std::size_t kRefillBits = bitsize_v<uint64_t> - 8;
+
+   _Source& _source;
+   byte_span _block;
+   std::size_t _block_pos;
+
+   uint64_t _acc;
+   std::size_t _acc_bits;
+
+   void refill() {
+      while (_acc_bits <= kRefillBits) {
+         if (_block_pos == _block._size) {
+            _block = _source.next();
+            _block_pos = 0;
+            if (_block._size == 0) {
+               return;
+            }
+         }
+         if (_block._size - _block_pos >= sizeof(uint64_t)) {
+            // Fill the accumulator with whole bytes in one load
+            uint64_t word;
+            if (is_little_endian()) {
+               memcpy(&word, _block._data + _block_pos, sizeof(uint64_t));
+            } else {
+               assert(false);
+            }
+            _acc |= word << _acc_bits;
+            _block_pos += to_byte(bitsize_v<uint64_t> - 1 - _acc_bits);
+            _acc_bits |= kRefillBits;
+            return;
+         }
+         _acc |= static_cast<uint64_t>(_block._data[_block_pos++]) << _acc_bits;
+         _acc_bits += 8;
+      }
+   }
+
+public:
+   using stream_integral = uint32_t;
+
+   explicit subblock_istream(_Source& source)
+         : _source(source), _block(), _block_pos(0), _acc(0), _acc_bits(0) {}
+   subblock_istream(subblock_istream&&) = delete;
+
+   // Bits past the end of the data read as 0
+   stream_integral peek_extract(std::size_t nbits) {
+      assert(nbits > 0 && nbits <= bitsize_v<stream_integral>);
+      if (_acc_bits < nbits) {
+         refill();
+      }
+      return static_cast<stream_integral>(_acc & ((uint64_t{1} << nbits) - 1));
+   }
+
+   void consume(std::size_t nbits) {
+      if (nbits >= _acc_bits) {
+         _acc = 0;
+         _acc_bits = 0;
+      } else {
+         _acc >>= nbits;
+         _acc_bits -= nbits;
+      }
+   }
+
+   stream_integral read_extract(std::size_t nbits) {
+      const stream_integral ret = peek_extract(nbits);
+      consume(nbits);
+      return ret;
+   }
+
+   // Skips whatever data is left, leaving the source past the block terminator
+   void seek_end() {
+      while (_source.next()._size != 0) {}
+      _block = byte_span();
+      _block_pos = 0;
+      _acc = 0;
+      _acc_bits = 0;
+   }
+
+   bool eof() {
+      if (_acc_bits == 0) {
+         refill();
+      }
+      return _acc_bits == 0;
+   }
+};
+
+// Upper bound on the size of nbytes of data once framed into sub-blocks, including the block terminator
+constexpr std::size_t subblock_bound(std::size_t nbytes) {
+   return nbytes + (nbytes + kMaxSubblockSize - 1) / kMaxSubblockSize + 1;
+}
+
+// Variable-bitwidth ostream which frames its data into GIF data sub-blocks as it is written, putting a length byte
+// ahead of every kMaxSubblockSize bytes and the block terminator at the end, so the sink holds the bytes as they go in
+// the file. Matches the parts of the vbw_ostream interface used by the LZW compressors.
+class subblock_ostream {
+private:
+   std::vector<uint8_t>& _sink;
+   // Offset of the current block's length byte in _sink
+   std::size_t _block_start;
+   std::size_t _block_size;
+
+   uint64_t _acc;
+   std::size_t _acc_bits;
+   std::size_t _bits_written;
+   bool _finished;
+
+   void put_byte(uint8_t value) {
+      if (_block_size == kMaxSubblockSize) {
+         _sink[_block_start] = static_cast<uint8_t>(kMaxSubblockSize);
+         _block_start = _sink.size();
+         _sink.push_back(0);
+         _block_size = 0;
+      }
+      _sink.push_back(value);
+      _block_size++;
+   }
+
+   void store_word() {
+      if (_block_size + sizeof(uint32_t) <= kMaxSubblockSize) {
+         const std::size_t pos = _sink.size();
+         _sink.resize(pos + sizeof(uint32_t));
+         if (is_little_endian()) {
+            memcpy(_sink.data() + pos, &_acc, sizeof(uint32_t));
+         } else {
+            assert(false);
+         }
+         _block_size += sizeof(uint32_t);
+      } else {
+         for (std::size_t i = 0; i < sizeof(uint32_t); i++) {
+            put_byte(static_cast<uint8_t>(_acc >> to_bit(i)));
+         }
+      }
+      _acc >>= bitsize_v<uint32_t>;
+      _acc_bits -= bitsize_v<uint32_t>;
+   }
+
+   void write_bits(uint32_t value, std::size_t nbits) {
+      assert(!_finished && nbits <= bitsize_v<uint32_t>);
+      _acc |= static_cast<uint64_t>(value) << _acc_bits;
+      _acc_bits += nbits;
+      _bits_written += nbits;
+      if (_acc_bits >= bitsize_v<uint32_t>) {
+         store_word();
+      }
+   }
+
+public:
+   // Data is appended after whatever sink already holds
+   explicit subblock_ostream(std::vector<uint8_t>& sink)
+         : _sink(sink), _block_start(sink.size()), _block_size(0), _acc(0), _acc_bits(0), _bits_written(0),
+           _finished(false) {
+      _sink.push_back(0);
+   }
+   subblock_ostream(subblock_ostream&&) = delete;
+   ~subblock_ostream() {
+      flush();
+   }
+
+   template <typename T>
+   void write(bitfld<T> value) {
+      static_assert(sizeof(T) <= sizeof(uint32_t), "subblock_ostream only supports writes of up to 32 bits");
+      const bitfld<T> lsb_value = value.extract_to_lsb();
+      write_bits(static_cast<uint32_t>(lsb_value._value), static_cast<std::size_t>(lsb_value.mask_len()));
+   }
+
+   // Appends the first nbits bits of data written by a vbw_ostream
+   void append(byte_span data, std::size_t nbits) {
+      bit_reader reader(data._data, data._size, nbits);
+      while (nbits > 0) {
+         const std::size_t chunk_bits = std::min(nbits, bitsize_v<uint32_t>);
+         write_bits(reader.read(chunk_bits), chunk_bits);
+         nbits -= chunk_bits;
+      }
+   }
+
+   // Pads the data out to a whole byte and ends the last sub-block with the block terminator. Unlike
+   // vbw_ostream::flush, nothing more can be written after this.
+   void flush() {
+      if (_finished) {
+         return;
+      }
+      while (_acc_bits > 0) {
+         put_byte(static_cast<uint8_t>(_acc));
+         _acc >>= 8;
+         _acc_bits = _acc_bits > 8 ? _acc_bits - 8 : 0;
+      }
+      // Without any data, the empty first block's length byte is the terminator
+      if (_block_size > 0) {
+         _sink[_block_start] = static_cast<uint8_t>(_block_size);
+         _sink.push_back(0);
+      }
+      _finished = true;
+   }
+
+   // Bits of data written, not counting the block framing
+   constexpr std::size_t size() const {
+      return _bits_written;
+   }
+};
+
+}
@@ -1,6 +1,12 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <random>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "bitfield.hh"
 #include "bitstream.hh"
@@ -9,6 +15,8 @@
 #include "lzw.hh"
 #include "piximg.hh"
 #include "quantize.hh"
+#include "subblock.hh"
+#include "thread_pool.hh"
 
 void test_cbw_istream() {
    std::vector<uint8_t> sample;
@@ -32,6 +40,29 @@ void test_cbw_istream() {
    }
 }
 
+void test_bit_reader() {
+   std::vector<uint8_t> sample;
+   for (int i = 0; i < 37; i++) {
+      sample.push_back(static_cast<uint8_t>(i * 37 + 11));
+   }
+   const std::size_t nbits = gifproc::util::to_bit(sample.size()) - 3;
+   gifproc::util::bit_reader reader(sample.data(), sample.size(), nbits);
+   gifproc::util::vbw_istream stream(sample, nbits);
+
+   std::size_t width = 1;
+   while (!reader.eof()) {
+      const uint32_t peeked = reader.peek(width);
+      assert(peeked == reader.read(width));
+      assert(peeked == stream.peek_extract(width));
+      stream.consume(width);
+      width = (width % 13) + 1;
+   }
+   assert(stream.eof());
+   reader.rewind(nbits + 5);
+   assert(reader.tell() == 0);
+   printf("bit_reader consumed %ld of %ld bits\n", stream.eof() ? nbits : 0, nbits);
+}
+
 void test_vbw_iostreams() {
    using gifproc::util::bitfld;
    using gifproc::util::create_nbits;
@@ -45,6 +76,7 @@ void test_vbw_iostreams() {
    vbwo << create_nbits<uint8_t>(8, 4);
    vbwo << create_nbits<uint8_t>(0, 4);
    vbwo << create_nbits<uint8_t>(62, 6);
+   vbwo.flush();
 
    gifproc::util::vbw_istream vbwi(sample, vbwo.size());
    bitfld<uint32_t> val;
@@ -64,6 +96,1041 @@ void test_vbw_iostreams() {
    printf("val: %x  nbits: %d\n", val._value, val.mask_len());
 }
 
+void test_span_bitstreams() {
+   std::array<uint8_t, 64> raw_data;
+   for (std::size_t i = 0; i < raw_data.size(); i++) {
+      raw_data[i] = static_cast<uint8_t>(i / 5);
+   }
+   const gifproc::util::byte_span raw_view(raw_data.data(), raw_data.size());
+
+   // Too small for the compressed data, should be reported rather than written past
+   std::array<uint8_t, 8> small_out;
+   gifproc::lzw::lzw_encode_result small_result = gifproc::lzw::lzw_compress(
+         raw_view, gifproc::util::to_bit(raw_data.size()), 8,
+         gifproc::util::mutable_byte_span(small_out.data(), small_out.size()));
+   assert(small_result._overflow);
+
+   std::array<uint8_t, 128> compressed;
+   gifproc::lzw::lzw_encode_result result = gifproc::lzw::lzw_compress(
+         raw_view, gifproc::util::to_bit(raw_data.size()), 8,
+         gifproc::util::mutable_byte_span(compressed.data(), compressed.size()));
+   assert(!result._overflow);
+
+   std::array<uint8_t, 64> decompressed;
+   gifproc::lzw::lzw_decode_result decode_result = gifproc::lzw::lzw_decompress(
+         gifproc::util::byte_span(compressed.data(), gifproc::util::to_byte(result._bits_written + 7)),
+         gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), 8);
+   assert(decode_result._status == gifproc::lzw::decompress_status::kSuccess);
+   assert(decompressed == raw_data);
+   printf("span roundtrip: %ld raw bits, %ld compressed bits\n", gifproc::util::to_bit(raw_data.size()),
+          result._bits_written);
+}
+
+template <std::size_t _Bits>
+void test_lzw_decompress_indices() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+   std::uniform_int_distribution<int> random_dist(0, (1 << _Bits) - 1);
+
+   std::vector<uint8_t> packed, compressed;
+   std::vector<uint8_t> indices(300 * 200);
+   {
+      gifproc::util::cbw_ostream<_Bits> packed_stream(packed);
+      for (uint8_t& index : indices) {
+         index = static_cast<uint8_t>(random_dist(engine) / 3);
+         packed_stream << index;
+      }
+   }
+   gifproc::lzw::lzw_compress(packed, indices.size() * _Bits, _Bits, compressed);
+
+   std::vector<uint8_t> decompressed(indices.size());
+   gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+         compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), _Bits);
+   assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+   assert(result._bits_written == gifproc::util::to_bit(indices.size()));
+   assert(decompressed == indices);
+
+   // Same data framed as GIF sub-blocks, with a short final block
+   std::vector<uint8_t> framed;
+   for (std::size_t off = 0; off < compressed.size(); off += 255) {
+      const std::size_t len = std::min<std::size_t>(255, compressed.size() - off);
+      framed.push_back(static_cast<uint8_t>(len));
+      framed.insert(framed.end(), compressed.begin() + off, compressed.begin() + off + len);
+   }
+   framed.push_back(0);
+   std::fill(decompressed.begin(), decompressed.end(), 0);
+   gifproc::util::span_block_source source(framed, 0);
+   gifproc::util::subblock_istream<gifproc::util::span_block_source> blocks(source);
+   result = gifproc::lzw::lzw_decompress_indices(
+         blocks, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), _Bits);
+   assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+   assert(decompressed == indices);
+   assert(!source.truncated());
+   printf("Decompressed %ld %ld bit indices to bytes\n", indices.size(), _Bits);
+}
+
+void test_lzw_contexts() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+   gifproc::lzw::lzw_encoder encoder;
+   gifproc::lzw::lzw_decoder decoder;
+
+   // Reused contexts must give the same results as fresh ones, across bpp changes and across codebook clears
+   for (uint8_t bpp : { 8, 3, 8, 2, 3 }) {
+      std::uniform_int_distribution<int> random_dist(0, (1 << bpp) - 1);
+      std::vector<uint8_t> packed, expected, compressed;
+      std::vector<uint8_t> indices(engine() % 20000 + 1);
+      {
+         gifproc::util::vbw_ostream packed_stream(packed);
+         for (uint8_t& index : indices) {
+            index = static_cast<uint8_t>(random_dist(engine));
+            packed_stream.write(gifproc::util::create_nbits<uint8_t>(index, bpp));
+         }
+      }
+      gifproc::lzw::lzw_compress(packed, indices.size() * bpp, bpp, expected);
+      encoder.compress(packed, indices.size() * bpp, bpp, compressed);
+      assert(compressed == expected);
+      compressed.clear();
+      encoder.compress(packed, indices.size() * bpp, bpp, compressed, gifproc::lzw::compress_method::kHashTable);
+      assert(compressed == expected);
+      for (gifproc::lzw::compress_method method : { gifproc::lzw::compress_method::kTrie,
+                                                    gifproc::lzw::compress_method::kHashTable }) {
+         compressed.clear();
+         encoder.compress_indices(indices, bpp, compressed, method);
+         assert(compressed == expected);
+      }
+
+      std::vector<uint8_t> decompressed(indices.size());
+      gifproc::lzw::lzw_decode_result result = decoder.decompress_indices(
+            compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp);
+      assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+      assert(decompressed == indices);
+   }
+   printf("Reused LZW contexts\n");
+}
+
+void test_subblock_ostream() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+   gifproc::util::thread_pool pool(3);
+   gifproc::lzw::lzw_encoder encoder;
+
+   // Framing the output as it is written must match framing it afterwards, including a last block filled exactly
+   for (std::size_t nbytes : { std::size_t{0}, std::size_t{1}, gifproc::kMaxSubblockSize,
+                               gifproc::kMaxSubblockSize * 3, std::size_t{10000} + engine() % 1000 }) {
+      std::vector<uint8_t> plain, framed = { 0xaa };
+      {
+         gifproc::util::vbw_ostream plain_out(plain);
+         gifproc::util::subblock_ostream framed_out(framed);
+         std::size_t nbits = gifproc::util::to_bit(nbytes);
+         while (nbits > 0) {
+            const std::size_t width = std::min<std::size_t>(nbits, engine() % 12 + 1);
+            const auto value = gifproc::util::create_nbits<uint16_t>(static_cast<uint16_t>(engine()), width);
+            plain_out.write(value);
+            framed_out.write(value);
+            nbits -= width;
+         }
+      }
+      std::vector<uint8_t> expected = { 0xaa };
+      for (std::size_t i = 0; i < plain.size(); i += gifproc::kMaxSubblockSize) {
+         const std::size_t block_size = std::min(gifproc::kMaxSubblockSize, plain.size() - i);
+         expected.push_back(static_cast<uint8_t>(block_size));
+         expected.insert(expected.end(), plain.begin() + i, plain.begin() + i + block_size);
+      }
+      expected.push_back(0);
+      assert(framed == expected);
+   }
+
+   // And compressing straight into sub-blocks decodes back through subblock_istream, one thread or several
+   std::vector<uint8_t> indices(50000 + engine() % 1000);
+   for (uint8_t& index : indices) {
+      index = static_cast<uint8_t>(engine() % 16);
+   }
+   for (bool parallel : { false, true }) {
+      std::vector<uint8_t> framed;
+      {
+         gifproc::util::subblock_ostream framed_out(framed);
+         if (parallel) {
+            gifproc::lzw::lzw_compress_indices_parallel(pool, indices, 4, framed_out,
+                                                        gifproc::lzw::parallel_compress_params(10000));
+         } else {
+            encoder.compress_indices(indices, 4, framed_out);
+         }
+      }
+      gifproc::util::span_block_source source(framed, 0);
+      gifproc::util::subblock_istream<gifproc::util::span_block_source> blocks(source);
+      std::vector<uint8_t> decompressed(indices.size());
+      gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+            blocks, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), 4);
+      assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+      assert(decompressed == indices);
+      assert(!source.truncated());
+   }
+   printf("Compressed into sub-blocks\n");
+}
+
+void test_subblock_index() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+
+   // Full blocks with a short last one take the fixed stride path, blocks of any size the general one
+   for (bool uniform : { true, false, true, false }) {
+      std::vector<uint8_t> payload(engine() % 3000 + 1);
+      for (uint8_t& byte : payload) {
+         byte = static_cast<uint8_t>(engine());
+      }
+      std::vector<uint8_t> framed = { 0x2c, 0x08 };
+      const std::size_t start = framed.size();
+      for (std::size_t i = 0; i < payload.size();) {
+         const std::size_t block_size = std::min<std::size_t>(
+               payload.size() - i, uniform ? gifproc::kMaxSubblockSize : engine() % gifproc::kMaxSubblockSize + 1);
+         framed.push_back(static_cast<uint8_t>(block_size));
+         framed.insert(framed.end(), payload.begin() + i, payload.begin() + i + block_size);
+         i += block_size;
+      }
+      framed.push_back(0);
+
+      gifproc::util::subblock_index index;
+      gifproc::util::span_block_source source(framed, start);
+      for (gifproc::util::byte_span block = source.next(); block._size > 0; block = source.next()) {
+         index.add_block(block._size);
+      }
+      assert(!source.truncated());
+      assert(index._payload_size == payload.size() && index.framed_size() == framed.size() - start);
+      assert(!uniform || index._uniform);
+
+      std::vector<uint8_t> gathered(index._payload_size);
+      gifproc::util::gather_subblocks(framed, start, index, gathered.data());
+      assert(gathered == payload);
+      if (index._nblocks == 1) {
+         const gifproc::util::byte_span block = gifproc::util::single_subblock(framed, start, index);
+         assert(std::equal(block._data, block._data + block._size, payload.begin(), payload.end()));
+      }
+   }
+   printf("Gathered indexed sub-blocks\n");
+}
+
+void test_lzw_parallel() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+   gifproc::util::thread_pool pool(3);
+
+   for (uint8_t bpp : { 2, 8 }) {
+      std::uniform_int_distribution<int> random_dist(0, (1 << bpp) - 1);
+      std::vector<uint8_t> indices(100000 + engine() % 1000);
+      uint8_t index = 0;
+      for (uint8_t& out_index : indices) {
+         if (engine() % 8 == 0) {
+            index = static_cast<uint8_t>(random_dist(engine));
+         }
+         out_index = index;
+      }
+
+      // Small enough segments for every thread to get one, where some end up right after a codebook clear
+      std::vector<uint8_t> compressed;
+      gifproc::lzw::lzw_compress_indices_parallel(pool, indices, bpp, compressed,
+                                                  gifproc::lzw::parallel_compress_params(7000));
+      std::vector<uint8_t> decompressed(indices.size());
+      gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+            compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp);
+      assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+      assert(result._bits_written == gifproc::util::to_bit(indices.size()));
+      assert(decompressed == indices);
+
+      std::fill(decompressed.begin(), decompressed.end(), 0);
+      result = gifproc::lzw::lzw_decompress_indices_parallel(
+            pool, compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp,
+            gifproc::lzw::parallel_decompress_params(7000));
+      assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+      assert(result._bits_written == gifproc::util::to_bit(indices.size()));
+      assert(decompressed == indices);
+
+      // Too small to split
+      std::vector<uint8_t> expected, single;
+      gifproc::lzw::lzw_compress_indices(indices, bpp, expected);
+      gifproc::lzw::lzw_compress_indices_parallel(pool, indices, bpp, single,
+                                                  gifproc::lzw::parallel_compress_params(indices.size()));
+      assert(single == expected);
+   }
+   printf("Compressed and decompressed indices in parallel\n");
+}
+
+void test_lzw_invalid_code() {
+   using gifproc::util::create_nbits;
+   gifproc::util::thread_pool pool(1);
+
+   // Clear, 0, then 7 at 2bpp where only codes up to 6 can be defined yet, then EOI
+   std::vector<uint8_t> compressed;
+   {
+      gifproc::util::vbw_ostream vbwo(compressed);
+      vbwo << create_nbits<uint8_t>(4, 3);
+      vbwo << create_nbits<uint8_t>(0, 3);
+      vbwo << create_nbits<uint8_t>(7, 3);
+      vbwo << create_nbits<uint8_t>(5, 3);
+   }
+
+   std::vector<uint8_t> decompressed(64);
+   gifproc::util::mutable_byte_span out(decompressed.data(), decompressed.size());
+   std::vector<uint8_t> packed;
+   assert(gifproc::lzw::lzw_decompress(compressed, packed, 2)._status ==
+          gifproc::lzw::decompress_status::kInvalidCompressCode);
+   assert(gifproc::lzw::lzw_decompress_indices(compressed, out, 2)._status ==
+          gifproc::lzw::decompress_status::kInvalidCompressCode);
+   // The pre-scan turns it down, leaving it to the same decoder
+   assert(gifproc::lzw::lzw_decompress_indices_parallel(pool, compressed, out, 2,
+                                                        gifproc::lzw::parallel_decompress_params(1))._status ==
+          gifproc::lzw::decompress_status::kInvalidCompressCode);
+   printf("Rejected an undefined LZW code\n");
+}
+
+void test_lzw_clear_policies() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+   gifproc::util::thread_pool pool(3);
+   gifproc::lzw::lzw_encoder encoder;
+   gifproc::lzw::lzw_decoder decoder;
+
+   // Runs of one index, switching to noise halfway through so the ratio monitored policy has something to clear for
+   for (uint8_t bpp : { 2, 5, 8 }) {
+      std::uniform_int_distribution<int> random_dist(0, (1 << bpp) - 1);
+      std::vector<uint8_t> indices(60000 + engine() % 20000);
+      uint8_t index = 0;
+      for (std::size_t i = 0; i < indices.size(); i++) {
+         if (i > indices.size() / 2 || engine() % 8 == 0) {
+            index = static_cast<uint8_t>(random_dist(engine));
+         }
+         indices[i] = index;
+      }
+
+      for (gifproc::lzw::clear_policy policy : { gifproc::lzw::clear_policy::kClearAtFull,
+                                                 gifproc::lzw::clear_policy::kDeferred,
+                                                 gifproc::lzw::clear_policy::kRatioMonitored }) {
+         std::vector<uint8_t> compressed, hash_compressed, parallel_compressed;
+         encoder.compress_indices(indices, bpp, compressed, gifproc::lzw::compress_method::kTrie, policy);
+         encoder.compress_indices(indices, bpp, hash_compressed, gifproc::lzw::compress_method::kHashTable, policy);
+         assert(compressed == hash_compressed);
+         gifproc::lzw::lzw_compress_indices_parallel(
+               pool, indices, bpp, parallel_compressed,
+               gifproc::lzw::parallel_compress_params(20000, gifproc::lzw::compress_method::kTrie, policy));
+
+         for (std::vector<uint8_t> const* stream : { &compressed, &parallel_compressed }) {
+            std::vector<uint8_t> decompressed(indices.size());
+            gifproc::lzw::lzw_decode_result result = decoder.decompress_indices(
+                  *stream, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp);
+            assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+            assert(decompressed == indices);
+
+            std::fill(decompressed.begin(), decompressed.end(), 0);
+            result = gifproc::lzw::lzw_decompress_indices_parallel(
+                  pool, *stream, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp,
+                  gifproc::lzw::parallel_decompress_params(10000));
+            assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+            assert(decompressed == indices);
+         }
+      }
+   }
+   printf("Compressed with each clear policy\n");
+}
+
+void test_lzw_lossy() {
+   std::random_device r;
+   std::default_random_engine engine(r());
+
+   // A gray ramp palette and a noisy gradient, where index 0 is transparent
+   constexpr uint32_t kMaxDistance = 24;
+   std::vector<gifproc::color_table_entry> palette(64);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      const uint8_t level = static_cast<uint8_t>(i * 4);
+      palette[i] = gifproc::color_table_entry { level, level, level };
+   }
+   std::vector<uint8_t> indices(256 * 256);
+   for (std::size_t i = 0; i < indices.size(); i++) {
+      const int level = static_cast<int>((i % 256) / 4) + static_cast<int>(engine() % 5) - 2;
+      indices[i] = engine() % 50 == 0 ? 0 : static_cast<uint8_t>(std::clamp(level, 1, 63));
+   }
+
+   std::vector<uint8_t> lossless, exact, lossy;
+   gifproc::lzw::lzw_compress_indices(indices, 6, lossless);
+   gifproc::lzw::lzw_compress_indices_lossy(indices, 6, gifproc::lzw::lossy_params(palette, 0, 0), exact);
+   assert(exact == lossless);
+   gifproc::lzw::lzw_compress_indices_lossy(indices, 6, gifproc::lzw::lossy_params(palette, kMaxDistance, 0), lossy);
+   assert(lossy.size() < lossless.size());
+
+   std::vector<uint8_t> decompressed(indices.size());
+   gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+         lossy, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), 6);
+   assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+   for (std::size_t i = 0; i < indices.size(); i++) {
+      // The carried error is at most kMaxDistance, so no pixel moves further than twice that
+      assert((indices[i] == 0) == (decompressed[i] == 0));
+      const int diff = palette[indices[i]]._red - palette[decompressed[i]]._red;
+      assert(3 * diff * diff <= static_cast<int>(4 * kMaxDistance * kMaxDistance));
+   }
+   printf("Lossy compressed %ld indices to %ld bytes, %ld lossless\n", indices.size(), lossy.size(), lossless.size());
+}
+
+void test_canvas_ostream() {
+   // 3x10 interlaced region at (1, 2) on a 6x12 canvas, with index 3 transparent
+   std::vector<gifproc::color_table_entry> palette(4);
+   for (uint8_t i = 0; i < palette.size(); i++) {
+      palette[i]._red = i * 10;
+      palette[i]._green = i * 20;
+      palette[i]._blue = i * 30;
+   }
+   gifproc::quant::gif_frame canvas(6, 12, 1, 2, 3, 10);
+   canvas._img.assign(canvas._w * canvas._h, gifproc::pixel(1, 2, 3, 4));
+   gifproc::quant::dequant_params params(true);
+   std::vector<uint8_t> scratch(30);
+   {
+      gifproc::quant::canvas_ostream out(canvas, params, palette, 3,
+                                         gifproc::util::mutable_byte_span(scratch.data(), scratch.size()));
+      // Each decoded row is filled with its position in decode order, mod 4
+      for (uint8_t i = 0; i < 10; i++) {
+         out << (i % 4) << (i % 4) << (i % 4);
+      }
+      out.finish();
+   }
+
+   constexpr std::array<uint8_t, 10> kDecodeRow = { 0, 5, 3, 6, 2, 7, 4, 8, 1, 9 };
+   for (std::size_t y = 0; y < canvas._h; y++) {
+      for (std::size_t x = 0; x < canvas._w; x++) {
+         gifproc::pixel const& p = canvas._img[(y * canvas._w) + x];
+         const bool in_region = x >= 1 && x < 4 && y >= 2 && y < 12;
+         const uint8_t index = in_region ? kDecodeRow[y - 2] % 4 : 3;
+         if (index == 3) {
+            assert(p._r == 1 && p._g == 2 && p._b == 3 && p._a == 4);
+         } else {
+            assert(p._r == index * 10 && p._g == index * 20 && p._b == index * 30 && p._a == 255);
+         }
+      }
+   }
+   printf("Dequantized interlaced indices to canvas\n");
+}
+
+void test_write_palette_sizes() {
+   constexpr const char* kPath = "palette_sizes_test.gif";
+   std::vector<gifproc::color_table_entry> palette(256);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i), static_cast<uint8_t>(255 - i), 7 };
+   }
+
+   // A local table using 3 of its 256 colors plus the transparent index, and a frame using 6 global colors
+   const std::vector<uint8_t> local_indices = { 3, 200, 17, 50, 3, 3, 200, 200, 17, 50, 50, 3 };
+   const std::vector<uint8_t> global_indices = { 0, 1, 2, 3, 4, 5, 5, 4, 3, 2, 1, 0 };
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      out_gif.add_frame(gifproc::quant::qimg(local_indices, palette, 8, local_indices.size() * 8, 0, 0, 4, 3, 50));
+      out_gif.add_frame(gifproc::quant::qimg(global_indices, {}, 8, global_indices.size() * 8, 0, 0, 4, 3, {}));
+      out_gif.finish_write(palette);
+   }
+
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(kPath) == gifproc::gif_parse_result::kSuccess);
+   assert(in_gif.nframes() == 2);
+   std::size_t frame_number = 0;
+   in_gif.foreach_frame([&] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const& ctx,
+                             std::vector<gifproc::color_table_entry> const& gct) {
+         std::vector<uint8_t> const& indices = frame_number == 0 ? local_indices : global_indices;
+         if (frame_number == 0) {
+            assert(ctx._descriptor._lct_present && in_gif.local_color_table(ctx).size() == 4);
+            assert(ctx._min_code_size == 2);
+         } else {
+            assert(!ctx._descriptor._lct_present && gct.size() == 8);
+            assert(ctx._min_code_size == 3);
+         }
+         for (std::size_t i = 0; i < indices.size(); i++) {
+            gifproc::pixel const& px = img._img[i];
+            if (frame_number == 0 && indices[i] == 50) {
+               assert(px._a == 0);
+            } else {
+               assert(px._r == palette[indices[i]]._red && px._g == palette[indices[i]]._green && px._a == 255);
+            }
+         }
+         frame_number++;
+      });
+   std::remove(kPath);
+   printf("Wrote compacted color tables\n");
+}
+
+void test_read_sources() {
+   constexpr const char* kPath = "read_sources_test.gif";
+   std::vector<gifproc::color_table_entry> palette(16);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i * 16), 0, static_cast<uint8_t>(255 - i) };
+   }
+   std::vector<uint8_t> indices(64 * 48);
+   for (std::size_t i = 0; i < indices.size(); i++) {
+      indices[i] = static_cast<uint8_t>((i / 7 + i % 5) % palette.size());
+   }
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 64, 48, {}));
+      std::reverse(indices.begin(), indices.end());
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 8, 8, 32, 24, 3));
+      out_gif.finish_write();
+   }
+
+   auto decode_all = [] (gifproc::gif& in_gif) {
+      std::vector<gifproc::pixel> pixels;
+      in_gif.foreach_frame([&pixels] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const&,
+                                      std::vector<gifproc::color_table_entry> const&) {
+            pixels.insert(pixels.end(), img._img.begin(), img._img.end());
+         });
+      return pixels;
+   };
+
+   // The same frames come out of the mapped file and out of a stream read into memory
+   gifproc::gif mapped_gif;
+   assert(mapped_gif.open_read(kPath) == gifproc::gif_parse_result::kSuccess);
+   gifproc::gif stream_gif;
+   assert(stream_gif.open_read(std::ifstream(kPath, std::ios::binary)) == gifproc::gif_parse_result::kSuccess);
+   assert(mapped_gif.nframes() == 2 && stream_gif.nframes() == 2);
+   const std::vector<gifproc::pixel> mapped_pixels = decode_all(mapped_gif);
+   const std::vector<gifproc::pixel> stream_pixels = decode_all(stream_gif);
+   assert(mapped_pixels.size() == stream_pixels.size());
+   assert(memcmp(mapped_pixels.data(), stream_pixels.data(), mapped_pixels.size() * sizeof(gifproc::pixel)) == 0);
+
+   // And out of a caller's buffer, which is borrowed rather than copied
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   gifproc::gif buffer_gif;
+   assert(buffer_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   const std::vector<gifproc::pixel> buffer_pixels = decode_all(buffer_gif);
+   assert(buffer_pixels.size() == stream_pixels.size());
+   assert(memcmp(buffer_pixels.data(), stream_pixels.data(), buffer_pixels.size() * sizeof(gifproc::pixel)) == 0);
+   // Truncated data fails to parse instead of being read past
+   assert(buffer_gif.open_read(gifproc::util::byte_span(file_data.data(), file_data.size() / 2)) ==
+          gifproc::gif_parse_result::kUnexpectedEof);
+
+   // Still decodes from the mapping after being moved
+   gifproc::gif moved_gif(std::move(mapped_gif));
+   const std::vector<gifproc::pixel> moved_pixels = decode_all(moved_gif);
+   assert(memcmp(moved_pixels.data(), stream_pixels.data(), moved_pixels.size() * sizeof(gifproc::pixel)) == 0);
+
+   gifproc::gif missing_gif;
+   assert(missing_gif.open_read("read_sources_missing.gif") == gifproc::gif_parse_result::kFileNotFound);
+   std::remove(kPath);
+   printf("Read from a mapped file, a stream and a buffer\n");
+}
+
+void test_push_read() {
+   constexpr const char* kPath = "push_read_test.gif";
+   std::vector<gifproc::color_table_entry> palette(16);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { 0, static_cast<uint8_t>(i * 16), static_cast<uint8_t>(i) };
+   }
+   std::vector<uint8_t> indices(80 * 60);
+   for (std::size_t i = 0; i < indices.size(); i++) {
+      indices[i] = static_cast<uint8_t>((i / 3 + i % 11) % palette.size());
+   }
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 80, 60, {}), 10);
+      std::reverse(indices.begin(), indices.end());
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 4, 4, 40, 30, 5), 20);
+      out_gif.add_frame(gifproc::quant::qimg(indices, {}, 8, indices.size() * 8, 0, 0, 80, 60, {}), 30);
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+
+   std::vector<gifproc::pixel> expected;
+   gifproc::gif whole_gif;
+   assert(whole_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   whole_gif.foreach_frame([&expected] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const&,
+                                        std::vector<gifproc::color_table_entry> const&) {
+         expected.insert(expected.end(), img._img.begin(), img._img.end());
+      });
+
+   // Chunks of every size from a byte at a time up, so blocks are cut off at every point along the way
+   for (std::size_t chunk_size : { 1, 7, 64, 255, 1000, 100000 }) {
+      std::vector<gifproc::pixel> pixels;
+      std::vector<uint16_t> delays;
+      bool screen_seen = false;
+      bool trailer_seen = false;
+      gifproc::gif_push_callbacks callbacks;
+      callbacks._on_screen = [&screen_seen] (gifproc::logical_screen_descriptor const& lsd,
+                                             std::vector<gifproc::color_table_entry> const& gct) {
+         assert(lsd._canvas_width == 80 && lsd._canvas_height == 60 && gct.size() == 16);
+         screen_seen = true;
+      };
+      callbacks._on_frame = [&] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const& ctx,
+                                 std::vector<gifproc::color_table_entry> const&) {
+         assert(screen_seen && !trailer_seen);
+         pixels.insert(pixels.end(), img._img.begin(), img._img.end());
+         delays.push_back(uint16_t{ctx._extension->_delay_time});
+      };
+      callbacks._on_trailer = [&trailer_seen] () {
+         trailer_seen = true;
+      };
+
+      gifproc::gif push_gif;
+      push_gif.begin_push_read(std::move(callbacks));
+      gifproc::gif_parse_result result = gifproc::gif_parse_result::kNeedMoreData;
+      for (std::size_t pos = 0; pos < file_data.size(); pos += chunk_size) {
+         assert(result == gifproc::gif_parse_result::kNeedMoreData);
+         const std::size_t len = std::min(chunk_size, file_data.size() - pos);
+         result = push_gif.push_read(gifproc::util::byte_span(file_data.data() + pos, len));
+      }
+      assert(result == gifproc::gif_parse_result::kSuccess && trailer_seen);
+      assert((delays == std::vector<uint16_t> { 10, 20, 30 }));
+      assert(pixels.size() == expected.size());
+      assert(memcmp(pixels.data(), expected.data(), pixels.size() * sizeof(gifproc::pixel)) == 0);
+      assert(push_gif.nframes() == 3);
+   }
+
+   // Data that could never be a gif fails as soon as there is enough of it to tell
+   gifproc::gif bad_gif;
+   bad_gif.begin_push_read(gifproc::gif_push_callbacks());
+   assert(bad_gif.push_read(gifproc::util::byte_span(file_data.data(), 3)) ==
+          gifproc::gif_parse_result::kNeedMoreData);
+   const uint8_t not_gif[] = { 'P', 'N', 'G' };
+   assert(bad_gif.push_read(gifproc::util::byte_span(not_gif, sizeof(not_gif))) ==
+          gifproc::gif_parse_result::kInvalidHeader);
+   printf("Parsed a gif pushed in chunks\n");
+}
+
+void test_probe() {
+   std::vector<gifproc::color_table_entry> palette(4);
+   std::vector<uint8_t> indices(32 * 32);
+   for (std::size_t i = 0; i < indices.size(); i++) {
+      indices[i] = static_cast<uint8_t>(i % 3);
+   }
+   std::vector<std::string> paths;
+   for (std::size_t nframes = 1; nframes <= 6; nframes++) {
+      paths.push_back("probe_test_" + std::to_string(nframes) + ".gif");
+      gifproc::gif out_gif;
+      out_gif.open_write(paths.back());
+      for (std::size_t i = 0; i < nframes; i++) {
+         const std::optional<uint16_t> delay = i % 2 == 0 ? std::make_optional<uint16_t>(i * 10 + 5) : std::nullopt;
+         out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 32, 32, {}), delay);
+      }
+      out_gif.finish_write();
+   }
+   paths.push_back("probe_test_missing.gif");
+
+   gifproc::util::thread_pool pool(4);
+   std::vector<gifproc::gif_parse_result> results;
+   std::vector<gifproc::gif_summary> summaries;
+   gifproc::probe_batch(pool, paths, 2, results, summaries);
+   assert(results.size() == paths.size() && summaries.size() == paths.size());
+   assert(results.back() == gifproc::gif_parse_result::kFileNotFound);
+
+   // Matches what a full open finds
+   for (std::size_t p = 0; p + 1 < paths.size(); p++) {
+      gifproc::gif_summary const& summary = summaries[p];
+      assert(results[p] == gifproc::gif_parse_result::kSuccess);
+      gifproc::gif in_gif;
+      assert(in_gif.open_read(paths[p]) == gifproc::gif_parse_result::kSuccess);
+      assert(summary._canvas_width == in_gif.width() && summary._canvas_height == in_gif.height());
+      assert(summary._frames.size() == in_gif.nframes() && summary._loop_count == 0);
+      uint64_t total = 0;
+      std::size_t frame_number = 0;
+      in_gif.foreach_frame([&] (gifproc::quant::gif_frame const&, gifproc::gif_frame_context const& ctx,
+                                std::vector<gifproc::color_table_entry> const&) {
+            const uint16_t delay = ctx._extension ? ctx._extension->_delay_time : 0;
+            assert(summary._frames[frame_number]._delay_time == delay);
+            total += delay;
+            frame_number++;
+         });
+      assert(summary._total_duration == total);
+      std::remove(paths[p].c_str());
+   }
+   printf("Probed %ld gifs\n", paths.size());
+}
+
+namespace {
+// The writer only uses disposal method 0, which starts each frame from a clear canvas. This sets frame i of a written
+// file to method_of(i), so frames can be made to build on the ones before, and returns how many frames were set.
+template <typename F>
+std::size_t set_disposal_methods(std::vector<uint8_t>& file_data, F&& method_of) {
+   std::size_t npatched = 0;
+   for (std::size_t i = 0; i + 3 < file_data.size(); i++) {
+      if (file_data[i] == gifproc::kExtensionIntroducer && file_data[i + 1] == gifproc::kGraphicsExtensionLabel &&
+          file_data[i + 2] == gifproc::kGraphicsExtensionSize) {
+         file_data[i + 3] = static_cast<uint8_t>((file_data[i + 3] & ~0x1c) | (method_of(npatched) << 2));
+         npatched++;
+      }
+   }
+   return npatched;
+}
+
+gifproc::gif_disposal_method do_not_dispose(std::size_t) {
+   return gifproc::gif_disposal_method::kDoNotDispose;
+}
+}
+
+void test_seek_frame() {
+   constexpr const char* kPath = "seek_frame_test.gif";
+   constexpr std::size_t kFrames = 40;
+   std::vector<gifproc::color_table_entry> palette(8);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i * 32), static_cast<uint8_t>(i * 5), 1 };
+   }
+   // Every 13th frame is opaque and covers the whole canvas, the rest are smaller and partly transparent
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      for (std::size_t f = 0; f < kFrames; f++) {
+         const bool full = f % 13 == 0;
+         const uint16_t w = full ? 48 : 16;
+         const uint16_t h = full ? 32 : 12;
+         std::vector<uint8_t> indices(w * h);
+         for (std::size_t i = 0; i < indices.size(); i++) {
+            indices[i] = static_cast<uint8_t>((i * (f + 1) / 5) % palette.size());
+         }
+         const uint16_t x = full ? 0 : static_cast<uint16_t>(f % 4 * 8);
+         const uint16_t y = full ? 0 : static_cast<uint16_t>(f % 3 * 6);
+         out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, x, y, w, h,
+                                                full ? std::nullopt : std::make_optional<uint8_t>(f % 8)),
+                           static_cast<uint16_t>(f % 5 * 2));
+      }
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+   assert(set_disposal_methods(file_data, do_not_dispose) == kFrames);
+
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   std::vector<std::vector<gifproc::pixel>> expected;
+   std::vector<uint64_t> start_times;
+   uint64_t time = 0;
+   in_gif.foreach_frame([&] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const& ctx,
+                             std::vector<gifproc::color_table_entry> const&) {
+         assert(ctx._extension->_disposal_method == gifproc::gif_disposal_method::kDoNotDispose);
+         expected.push_back(img._img);
+         start_times.push_back(time);
+         time += ctx._extension->_delay_time;
+      });
+   assert(expected.size() == kFrames);
+
+   auto matches = [&expected] (gifproc::quant::gif_frame const& img, std::size_t f) {
+      return img._img.size() == expected[f].size() &&
+             memcmp(img._img.data(), expected[f].data(), img._img.size() * sizeof(gifproc::pixel)) == 0;
+   };
+   // Out of order, in order from the last seek, and with a budget too small for more than a couple of checkpoints
+   std::default_random_engine engine(1234);
+   for (std::size_t budget : { std::size_t{64} << 20, 48 * 32 * sizeof(gifproc::pixel) * 2 }) {
+      in_gif.set_seek_checkpoints(4, budget);
+      for (int i = 0; i < 100; i++) {
+         const std::size_t f = engine() % kFrames;
+         assert(matches(in_gif.seek_frame(f), f));
+      }
+      for (std::size_t f = 0; f < kFrames; f++) {
+         assert(matches(in_gif.seek_frame(f), f));
+      }
+   }
+
+   for (std::size_t f = 0; f < kFrames; f++) {
+      const std::size_t shown = in_gif.frame_at_time(start_times[f]);
+      // Frames without a delay are passed over straight away
+      assert(start_times[shown] == start_times[f] && shown >= f);
+   }
+   assert(in_gif.frame_at_time(time + 1000) == kFrames - 1);
+   printf("Seeked to frames out of order\n");
+}
+
+namespace {
+// A gif of nframes frames building on each other, with one in the middle large enough to be split up within the frame
+std::vector<uint8_t> make_layered_gif(std::size_t nframes, uint16_t small_size) {
+   constexpr const char* kPath = "layered_test.gif";
+   std::vector<gifproc::color_table_entry> palette(64);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i * 4), static_cast<uint8_t>(255 - i), 9 };
+   }
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      for (std::size_t f = 0; f < nframes; f++) {
+         const uint16_t size = f == nframes / 2 ? 1024 : static_cast<uint16_t>(small_size - f % 7 * 4);
+         std::vector<uint8_t> indices(std::size_t{size} * size);
+         for (std::size_t i = 0; i < indices.size(); i++) {
+            indices[i] = static_cast<uint8_t>((i / (f % 5 + 1) + f) % palette.size());
+         }
+         out_gif.add_frame(gifproc::quant::qimg(indices, {}, 8, indices.size() * 8, static_cast<uint16_t>(f % 7 * 2),
+                                                0, size, size, static_cast<uint8_t>(f % palette.size())), 3);
+      }
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+   assert(set_disposal_methods(file_data, do_not_dispose) == nframes);
+   return file_data;
+}
+
+std::vector<std::vector<gifproc::pixel>> decode_all_frames(gifproc::gif& in_gif) {
+   std::vector<std::vector<gifproc::pixel>> frames;
+   in_gif.foreach_frame([&frames] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const& ctx,
+                                   std::vector<gifproc::color_table_entry> const&) {
+         assert(ctx._frame_number == frames.size());
+         frames.push_back(img._img);
+      });
+   return frames;
+}
+
+bool same_frames(std::vector<std::vector<gifproc::pixel>> const& lhs,
+                 std::vector<std::vector<gifproc::pixel>> const& rhs) {
+   return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [] (auto const& lhs_px, auto const& rhs_px) {
+         return lhs_px.size() == rhs_px.size() &&
+                memcmp(lhs_px.data(), rhs_px.data(), lhs_px.size() * sizeof(gifproc::pixel)) == 0;
+      });
+}
+}
+
+void test_foreach_frame_parallel() {
+   const std::vector<uint8_t> file_data = make_layered_gif(30, 64);
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   const std::vector<std::vector<gifproc::pixel>> expected = decode_all_frames(in_gif);
+
+   gifproc::util::thread_pool pool(3);
+   in_gif.set_thread_pool(&pool);
+   for (std::size_t lookahead : { 1, 4, 8, 100 }) {
+      in_gif.set_decode_lookahead(lookahead);
+      assert(same_frames(decode_all_frames(in_gif), expected));
+   }
+   in_gif.set_thread_pool(nullptr);
+   printf("Decoded frames ahead on a thread pool\n");
+}
+
+void test_foreach_frame_nested() {
+   const std::vector<uint8_t> file_data = make_layered_gif(12, 48);
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   const std::vector<std::vector<gifproc::pixel>> expected = decode_all_frames(in_gif);
+
+   // The only worker runs one of the iterations, so decodes it queues can't start until it's done with them
+   gifproc::util::thread_pool pool(1);
+   std::vector<std::vector<std::vector<gifproc::pixel>>> decoded(2);
+   pool.parallel_for(decoded.size(), [&] (std::size_t i) {
+         gifproc::gif nested_gif;
+         assert(nested_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+         nested_gif.set_thread_pool(&pool);
+         decoded[i] = decode_all_frames(nested_gif);
+      });
+   for (auto const& frames : decoded) {
+      assert(same_frames(frames, expected));
+   }
+
+   // Decodes still running when exec throws are finished before the gif goes away
+   for (std::size_t throw_at : { 0, 3, 11 }) {
+      gifproc::gif throwing_gif;
+      assert(throwing_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+      throwing_gif.set_thread_pool(&pool);
+      bool thrown = false;
+      try {
+         throwing_gif.foreach_frame([throw_at] (gifproc::quant::gif_frame const&,
+                                                gifproc::gif_frame_context const& ctx,
+                                                std::vector<gifproc::color_table_entry> const&) {
+               if (ctx._frame_number == throw_at) {
+                  throw std::runtime_error("stop");
+               }
+            });
+      } catch (std::runtime_error const&) {
+         thrown = true;
+      }
+      assert(thrown);
+   }
+   printf("Decoded frames ahead from within the pool\n");
+}
+
+void test_composite_all_frames() {
+   constexpr const char* kPath = "composite_all_test.gif";
+   constexpr std::size_t kFrames = 20;
+   constexpr std::size_t kClearingFrame = 12;
+   std::vector<gifproc::color_table_entry> palette(16);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i * 8), 40, static_cast<uint8_t>(i * 16) };
+   }
+   // Every 5th frame and the last are opaque and cover the whole canvas. The rest are partly transparent, and all but
+   // one of them are smaller.
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      for (std::size_t f = 0; f < kFrames; f++) {
+         const bool opaque = f % 5 == 0 || f == kFrames - 1;
+         const bool full = opaque || f == kClearingFrame;
+         const uint16_t w = full ? 48 : 20;
+         const uint16_t h = full ? 32 : 10;
+         std::vector<uint8_t> indices(w * h);
+         for (std::size_t i = 0; i < indices.size(); i++) {
+            indices[i] = static_cast<uint8_t>((i * 3 / (f + 2) + f) % palette.size());
+         }
+         const uint16_t x = full ? 0 : static_cast<uint16_t>(f % 3 * 9);
+         const uint16_t y = full ? 0 : 2;
+         out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, x, y, w, h,
+                                                opaque ? std::nullopt : std::make_optional<uint8_t>(f % 16)),
+                           5);
+      }
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+   // The full transparent frame clears the canvas when it is disposed of, so the frame after it starts afresh
+   assert(set_disposal_methods(file_data, [] (std::size_t f) {
+         return f == kClearingFrame ? gifproc::gif_disposal_method::kRestoreToBackground :
+                                      gifproc::gif_disposal_method::kDoNotDispose;
+      }) == kFrames);
+
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   assert((in_gif.independent_segments() == std::vector<std::size_t> { 0, 5, 10, kClearingFrame + 1, 15, 19 }));
+   const std::vector<std::vector<gifproc::pixel>> expected = decode_all_frames(in_gif);
+
+   gifproc::util::thread_pool pool(3);
+   for (gifproc::util::thread_pool* frame_pool : { static_cast<gifproc::util::thread_pool*>(nullptr), &pool }) {
+      in_gif.set_thread_pool(frame_pool);
+      std::vector<std::vector<gifproc::pixel>> composited;
+      for (gifproc::quant::gif_frame const& frame : in_gif.composite_all_frames()) {
+         composited.push_back(frame._img);
+      }
+      assert(same_frames(composited, expected));
+   }
+   in_gif.set_thread_pool(nullptr);
+   printf("Composited independent segments in parallel\n");
+}
+
+void test_offscreen_regions() {
+   constexpr const char* kPath = "offscreen_test.gif";
+   std::vector<gifproc::color_table_entry> palette(4);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i * 60), 90, 200 };
+   }
+   // Each frame is cleared away when it's disposed of, and every one reaches past the 20x12 canvas patched in below
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      std::vector<uint8_t> indices(24 * 16, 1);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 24, 16, {}), 5);
+      indices.assign(4 * 4, 2);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 18, 10, 4, 4, {}), 5);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 20, 4, 4, 4, {}), 5);
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+   assert(set_disposal_methods(file_data, [] (std::size_t) {
+         return gifproc::gif_disposal_method::kRestoreToBackground;
+      }) == 3);
+   file_data[6] = 20;
+   file_data[7] = 0;
+   file_data[8] = 12;
+   file_data[9] = 0;
+
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   const std::vector<std::vector<gifproc::pixel>> expected = decode_all_frames(in_gif);
+   assert(expected.size() == 3 && expected[0].size() == 20 * 12);
+   // The first frame is gone by the second, which only has its top left corner on the canvas
+   assert(std::count_if(expected[1].begin(), expected[1].end(), [] (gifproc::pixel px) { return px._a != 0; }) == 4);
+   // The third is entirely to the right of the canvas
+   assert(std::count_if(expected[2].begin(), expected[2].end(), [] (gifproc::pixel px) { return px._a != 0; }) == 0);
+
+   std::vector<std::vector<gifproc::pixel>> frames;
+   for (gifproc::quant::gif_frame const& frame : in_gif.composite_all_frames()) {
+      frames.push_back(frame._img);
+   }
+   assert(same_frames(frames, expected));
+
+   frames.clear();
+   for (std::size_t f : { 2, 1, 0, 2 }) {
+      frames.push_back(in_gif.seek_frame(f)._img);
+   }
+   assert(same_frames(frames, { expected[2], expected[1], expected[0], expected[2] }));
+
+   frames.clear();
+   gifproc::gif push_gif;
+   gifproc::gif_push_callbacks callbacks;
+   callbacks._on_frame = [&frames] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const&,
+                                    std::vector<gifproc::color_table_entry> const&) {
+      frames.push_back(img._img);
+   };
+   push_gif.begin_push_read(std::move(callbacks));
+   for (std::size_t offset = 0; offset < file_data.size(); offset += 16) {
+      push_gif.push_read(gifproc::util::byte_span(file_data.data() + offset,
+                                                  std::min<std::size_t>(16, file_data.size() - offset)));
+   }
+   assert(same_frames(frames, expected));
+   printf("Disposed of frames reaching past the canvas\n");
+}
+
+void test_invalid_code_size() {
+   constexpr const char* kPath = "invalid_code_size_test.gif";
+   std::vector<gifproc::color_table_entry> palette(4);
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      std::vector<uint8_t> indices(4 * 4, 1);
+      out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 4, 4, {}), 5);
+      out_gif.finish_write(palette);
+   }
+   std::vector<uint8_t> file_data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      file_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+
+   std::size_t code_size_offset = 0;
+   {
+      gifproc::gif in_gif;
+      assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+      in_gif.foreach_frame([&] (gifproc::quant::gif_frame const&, gifproc::gif_frame_context const& ctx,
+                                std::vector<gifproc::color_table_entry> const&) {
+            code_size_offset = ctx._image_data_start - 1;
+         });
+   }
+   for (uint8_t code_size : { 0, 1, 9, 255 }) {
+      file_data[code_size_offset] = code_size;
+      gifproc::gif in_gif;
+      assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kInvalidCodeSize);
+      gifproc::gif push_gif;
+      push_gif.begin_push_read(gifproc::gif_push_callbacks());
+      assert(push_gif.push_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kInvalidCodeSize);
+   }
+
+   // The decoders turn it down themselves too
+   std::vector<uint8_t> compressed;
+   gifproc::lzw::lzw_compress_indices(std::vector<uint8_t>(16, 1), 2, compressed);
+   std::vector<uint8_t> decompressed(16);
+   gifproc::util::mutable_byte_span out(decompressed.data(), decompressed.size());
+   std::vector<uint8_t> packed;
+   for (uint8_t bpp : { 0, 9 }) {
+      assert(gifproc::lzw::lzw_decompress(compressed, packed, bpp)._status ==
+             gifproc::lzw::decompress_status::kInvalidCodeSize);
+      assert(gifproc::lzw::lzw_decompress_indices(compressed, out, bpp)._status ==
+             gifproc::lzw::decompress_status::kInvalidCodeSize);
+   }
+   printf("Rejected invalid LZW code sizes\n");
+}
+
 template <std::size_t _Bits>
 void test_lzw_random_compress() {
    std::random_device r;
@@ -75,6 +1142,7 @@ void test_lzw_random_compress() {
    for (int i = 0; i < 512 * 512; i++) {
       initial_stream << static_cast<uint8_t>(random_dist(engine));
    }
+   initial_stream.flush();
 
    double start = static_cast<double>(clock()) / CLOCKS_PER_SEC;
    gifproc::util::cbw_istream<8> raw_stream_in(raw_data, initial_stream.size());
@@ -101,6 +1169,221 @@ void test_lzw_random_compress() {
    }
 }
 
+// Times each compress_method over a 1024x1024 image at every bpp, once with noise and once with runs of one index
+void bench_lzw_compressors() {
+   constexpr std::size_t kPixels = 1024 * 1024;
+   constexpr int kRepeats = 5;
+   std::default_random_engine engine(1234);
+   gifproc::lzw::lzw_encoder encoder;
+
+   for (uint8_t bpp = 1; bpp <= 8; bpp++) {
+      for (bool runs : { false, true }) {
+         std::uniform_int_distribution<int> random_dist(0, (1 << bpp) - 1);
+         std::vector<uint8_t> packed;
+         {
+            gifproc::util::vbw_ostream packed_stream(packed);
+            uint8_t index = 0;
+            for (std::size_t i = 0; i < kPixels; i++) {
+               if (!runs || engine() % 16 == 0) {
+                  index = static_cast<uint8_t>(random_dist(engine));
+               }
+               packed_stream.write(gifproc::util::create_nbits<uint8_t>(index, bpp));
+            }
+         }
+
+         std::array<std::vector<uint8_t>, 2> compressed;
+         std::array<double, 2> msecs;
+         constexpr std::array<gifproc::lzw::compress_method, 2> kMethods = {
+            gifproc::lzw::compress_method::kTrie, gifproc::lzw::compress_method::kHashTable
+         };
+         for (std::size_t m = 0; m < kMethods.size(); m++) {
+            const std::clock_t start = std::clock();
+            for (int i = 0; i < kRepeats; i++) {
+               compressed[m].clear();
+               encoder.compress(packed, kPixels * bpp, bpp, compressed[m], kMethods[m]);
+            }
+            msecs[m] = 1000.0 * (std::clock() - start) / CLOCKS_PER_SEC / kRepeats;
+         }
+         assert(compressed[0] == compressed[1]);
+         printf("%d bpp %-5s trie %7.2f ms  hash %7.2f ms  (%ld bytes)\n", bpp, runs ? "runs" : "noise", msecs[0],
+                msecs[1], compressed[0].size());
+      }
+   }
+}
+
+namespace {
+// Maps the frames of a gif to indices into the colors seen so far, which matches the original indices up to order for
+// any gif with at most 256 colors. Colors past the first 256 share indices.
+std::vector<std::vector<uint8_t>> bench_frame_indices(const char* path) {
+   std::vector<std::vector<uint8_t>> frames;
+   gifproc::gif corpus_gif;
+   if (corpus_gif.open_read(path) != gifproc::gif_parse_result::kSuccess) {
+      printf("Skipping %s\n", path);
+      return frames;
+   }
+   std::unordered_map<uint32_t, uint8_t> colors;
+   corpus_gif.foreach_frame([&frames, &colors] (gifproc::quant::gif_frame const& img, gifproc::gif_frame_context const&,
+                                                std::vector<gifproc::color_table_entry> const&) {
+         std::vector<uint8_t>& indices = frames.emplace_back();
+         indices.reserve(img._region_w * img._region_h);
+         for (std::size_t y = img._region_y; y < img._region_y + img._region_h; y++) {
+            for (std::size_t x = img._region_x; x < img._region_x + img._region_w; x++) {
+               gifproc::pixel const& px = img._img[y * img._w + x];
+               const uint32_t color =
+                     (uint32_t{px._r} << 24) | (uint32_t{px._g} << 16) | (uint32_t{px._b} << 8) | px._a;
+               auto it = colors.try_emplace(color, static_cast<uint8_t>(colors.size())).first;
+               indices.push_back(it->second);
+            }
+         }
+      });
+   return frames;
+}
+}
+
+// Compares the output size and speed of each clear_policy on 8bpp synthetic images, followed by the frames of each gif
+// in paths
+void bench_lzw_clear_policies(int npaths, char** paths) {
+   constexpr std::size_t kPixels = 1024 * 1024;
+   constexpr int kRepeats = 3;
+   constexpr std::array<gifproc::lzw::clear_policy, 3> kPolicies = {
+      gifproc::lzw::clear_policy::kClearAtFull, gifproc::lzw::clear_policy::kDeferred,
+      gifproc::lzw::clear_policy::kRatioMonitored
+   };
+   std::default_random_engine engine(1234);
+   gifproc::lzw::lzw_encoder encoder;
+   gifproc::lzw::lzw_decoder decoder;
+
+   auto run = [&] (const char* name, std::vector<std::vector<uint8_t>> const& frames) {
+      std::array<std::size_t, kPolicies.size()> bytes = {};
+      std::array<double, kPolicies.size()> msecs = {};
+      std::vector<uint8_t> compressed;
+      for (std::size_t p = 0; p < kPolicies.size(); p++) {
+         const std::clock_t start = std::clock();
+         for (int i = 0; i < kRepeats; i++) {
+            bytes[p] = 0;
+            for (std::vector<uint8_t> const& indices : frames) {
+               compressed.clear();
+               encoder.compress_indices(indices, 8, compressed, gifproc::lzw::compress_method::kHashTable,
+                                        kPolicies[p]);
+               bytes[p] += compressed.size();
+            }
+         }
+         msecs[p] = 1000.0 * (std::clock() - start) / CLOCKS_PER_SEC / kRepeats;
+
+         // Every policy must still decode to the same indices
+         for (std::vector<uint8_t> const& indices : frames) {
+            compressed.clear();
+            encoder.compress_indices(indices, 8, compressed, gifproc::lzw::compress_method::kHashTable, kPolicies[p]);
+            std::vector<uint8_t> decompressed(indices.size());
+            decoder.decompress_indices(
+                  compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), 8);
+            assert(decompressed == indices);
+         }
+      }
+      printf("%-24s full %9ld B %7.2f ms  deferred %9ld B %7.2f ms  monitored %9ld B %7.2f ms\n", name, bytes[0],
+             msecs[0], bytes[1], msecs[1], bytes[2], msecs[2]);
+   };
+
+   // Runs of 16 colors, a fixed 64 pixel tile, and the tile switching to runs halfway through
+   std::uniform_int_distribution<int> color_dist(0, 15);
+   std::vector<uint8_t> runs(kPixels), tile(kPixels), change(kPixels);
+   uint8_t index = 0;
+   for (std::size_t i = 0; i < kPixels; i++) {
+      if (engine() % 16 == 0) {
+         index = static_cast<uint8_t>(color_dist(engine));
+      }
+      runs[i] = index;
+      tile[i] = static_cast<uint8_t>((i * 37 + (i / 1024) * 11) % 64);
+      change[i] = i < kPixels / 2 ? tile[i] : runs[i];
+   }
+   run("runs", { runs });
+   run("tile", { tile });
+   run("tile then runs", { change });
+
+   for (int i = 0; i < npaths; i++) {
+      const std::vector<std::vector<uint8_t>> frames = bench_frame_indices(paths[i]);
+      if (!frames.empty()) {
+         run(paths[i], frames);
+      }
+   }
+}
+
+// Times parsing a gif of many small frames, each with a local color table and its own delay, followed by each gif in
+// paths. Only parsing is timed, no frames are decoded.
+void bench_parse(int npaths, char** paths) {
+   constexpr int kRepeats = 20;
+   auto run = [] (const char* name, std::vector<uint8_t> const& data) {
+      gifproc::gif in_gif;
+      const std::clock_t start = std::clock();
+      for (int i = 0; i < kRepeats; i++) {
+         if (in_gif.open_read(gifproc::util::byte_span(data)) != gifproc::gif_parse_result::kSuccess) {
+            printf("Skipping %s\n", name);
+            return;
+         }
+      }
+      const double msecs = 1000.0 * (std::clock() - start) / CLOCKS_PER_SEC / kRepeats;
+      printf("%-24s %6ld frames %9ld B %8.3f ms\n", name, in_gif.nframes(), data.size(), msecs);
+   };
+
+   constexpr const char* kPath = "bench_parse.gif";
+   std::vector<gifproc::color_table_entry> palette(256);
+   for (std::size_t i = 0; i < palette.size(); i++) {
+      palette[i] = gifproc::color_table_entry { static_cast<uint8_t>(i), static_cast<uint8_t>(i * 3), 0 };
+   }
+   std::default_random_engine engine(1234);
+   {
+      gifproc::gif out_gif;
+      out_gif.open_write(kPath);
+      std::vector<uint8_t> indices(24 * 24);
+      for (int frame = 0; frame < 5000; frame++) {
+         for (uint8_t& index : indices) {
+            index = static_cast<uint8_t>(engine());
+         }
+         out_gif.add_frame(gifproc::quant::qimg(indices, palette, 8, indices.size() * 8, 0, 0, 24, 24, {}), 4);
+      }
+      out_gif.finish_write();
+   }
+   std::vector<uint8_t> data;
+   {
+      std::ifstream file(kPath, std::ios::binary);
+      data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+   }
+   std::remove(kPath);
+   run("5000 small frames", data);
+
+   for (int i = 0; i < npaths; i++) {
+      std::ifstream file(paths[i], std::ios::binary);
+      data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      run(paths[i], data);
+   }
+}
+
+// Times foreach_frame over a 300 frame gif of 200x200 frames building on each other, on the calling thread and then
+// with frames decoded ahead on a thread pool
+void bench_decode() {
+   constexpr int kRepeats = 3;
+   const std::vector<uint8_t> file_data = make_layered_gif(300, 200);
+   gifproc::gif in_gif;
+   assert(in_gif.open_read(gifproc::util::byte_span(file_data)) == gifproc::gif_parse_result::kSuccess);
+   gifproc::util::thread_pool pool;
+
+   for (gifproc::util::thread_pool* frame_pool : { static_cast<gifproc::util::thread_pool*>(nullptr), &pool }) {
+      in_gif.set_thread_pool(frame_pool);
+      std::size_t nframes = 0;
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < kRepeats; i++) {
+         in_gif.foreach_frame([&nframes] (gifproc::quant::gif_frame const&, gifproc::gif_frame_context const&,
+                                          std::vector<gifproc::color_table_entry> const&) {
+               nframes++;
+            });
+      }
+      const std::chrono::duration<double, std::milli> msecs = std::chrono::steady_clock::now() - start;
+      printf("%-16s %ld frames %8.2f ms\n", frame_pool ? "decode ahead" : "calling thread", nframes / kRepeats,
+             msecs.count() / kRepeats);
+   }
+   printf("(%ld pool threads)\n", pool.size());
+}
+
 void test_make_funny(const char* path, int thickness, int range_b, int range_e) {
    gifproc::gif test_gif;
    auto read_result = test_gif.open_read(path);
@@ -140,8 +1423,90 @@ void test_make_funny(const char* path, int thickness, int range_b, int range_e)
    out_gif.finish_write(mq_ctx._palette);
 }
 
+void test_lzw_end_width() {
+   std::default_random_engine engine(7);
+   gifproc::util::thread_pool pool(2);
+
+   for (uint8_t bpp : { 2, 8 }) {
+      std::uniform_int_distribution<int> random_dist(0, (1 << bpp) - 1);
+      std::vector<uint8_t> indices(2400);
+      for (uint8_t& index : indices) {
+         index = static_cast<uint8_t>(random_dist(engine));
+      }
+
+      // Every length, so the input ends right as the codebook reaches each power of two
+      for (std::size_t len = 1; len <= indices.size() / 2; len++) {
+         gifproc::util::byte_span in(indices.data(), len);
+         for (auto method : { gifproc::lzw::compress_method::kTrie, gifproc::lzw::compress_method::kHashTable }) {
+            std::vector<uint8_t> compressed;
+            gifproc::lzw::lzw_compress_indices(in, bpp, compressed, method);
+            std::vector<uint8_t> decompressed(len);
+            gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+                  compressed, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp);
+            assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+            assert(std::equal(decompressed.begin(), decompressed.end(), indices.begin()));
+         }
+
+         // Two segments of len, the clear code ending the first has to be as wide as an EOI there
+         std::vector<uint8_t> stitched;
+         gifproc::lzw::lzw_compress_indices_parallel(pool, gifproc::util::byte_span(indices.data(), len * 2), bpp,
+                                                     stitched, gifproc::lzw::parallel_compress_params(len));
+         std::vector<uint8_t> decompressed(len * 2);
+         gifproc::lzw::lzw_decode_result result = gifproc::lzw::lzw_decompress_indices(
+               stitched, gifproc::util::mutable_byte_span(decompressed.data(), decompressed.size()), bpp);
+         assert(result._status == gifproc::lzw::decompress_status::kSuccess);
+         assert(std::equal(decompressed.begin(), decompressed.end(), indices.begin()));
+      }
+   }
+   printf("Ended LZW streams at every codebook size\n");
+}
+
+void run_tests() {
+   test_bit_reader();
+   test_vbw_iostreams();
+   test_span_bitstreams();
+   // GIF's minimum code size is 2, even for 1 bpp images
+   test_lzw_decompress_indices<2>();
+   test_lzw_decompress_indices<3>();
+   test_lzw_decompress_indices<4>();
+   test_lzw_decompress_indices<5>();
+   test_lzw_decompress_indices<6>();
+   test_lzw_decompress_indices<7>();
+   test_lzw_decompress_indices<8>();
+   test_lzw_contexts();
+   test_subblock_ostream();
+   test_subblock_index();
+   test_lzw_parallel();
+   test_lzw_invalid_code();
+   test_lzw_clear_policies();
+   test_lzw_lossy();
+   test_lzw_end_width();
+   test_canvas_ostream();
+   test_write_palette_sizes();
+   test_read_sources();
+   test_push_read();
+   test_probe();
+   test_seek_frame();
+   test_foreach_frame_parallel();
+   test_foreach_frame_nested();
+   test_composite_all_frames();
+   test_offscreen_regions();
+   test_invalid_code_size();
+   printf("All tests passed\n");
+}
+
 int main(int argc, char** argv) {
-   if (argc == 2) {
+   if (argc == 2 && strcmp(argv[1], "--test") == 0) {
+      run_tests();
+   } else if (argc == 2 && strcmp(argv[1], "--bench-lzw") == 0) {
+      bench_lzw_compressors();
+   } else if (argc >= 2 && strcmp(argv[1], "--bench-lzw-clear") == 0) {
+      bench_lzw_clear_policies(argc - 2, argv + 2);
+   } else if (argc == 2 && strcmp(argv[1], "--bench-decode") == 0) {
+      bench_decode();
+   } else if (argc >= 2 && strcmp(argv[1], "--bench-parse") == 0) {
+      bench_parse(argc - 2, argv + 2);
+   } else if (argc == 2) {
       test_make_funny(argv[1], 6, 0, -1);
    } else if (argc == 4) {
       int val, val2, val3;
@@ -0,0 +1,100 @@
+#include "thread_pool.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace gifproc::util {
+
+thread_pool::thread_pool(std::size_t nthreads) : _stopping(false) {
+   if (nthreads == 0) {
+      const std::size_t hw_threads = std::thread::hardware_concurrency();
+      nthreads = hw_threads > 1 ? hw_threads - 1 : 1;
+   }
+   _workers.reserve(nthreads);
+   for (std::size_t i = 0; i < nthreads; i++) {
+      _workers.emplace_back([this] { worker_loop(); });
+   }
+}
+
+thread_pool::~thread_pool() {
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+   }
+   _task_ready.notify_all();
+   for (std::thread& worker : _workers) {
+      worker.join();
+   }
+}
+
+void thread_pool::worker_loop() {
+   for (;;) {
+      std::function<void()> task;
+      {
+         std::unique_lock<std::mutex> lock(_mutex);
+         _task_ready.wait(lock, [this] { return _stopping || !_tasks.empty(); });
+         // Anything still queued is finished before stopping
+         if (_tasks.empty()) {
+            return;
+         }
+         task = std::move(_tasks.front());
+         _tasks.pop_front();
+      }
+      task();
+   }
+}
+
+void thread_pool::submit(std::function<void()> task) {
+   {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+   }
+   _task_ready.notify_one();
+}
+
+void thread_pool::parallel_for(std::size_t n, std::function<void(std::size_t)> const& func) {
+   if (n == 0) {
+      return;
+   }
+
+   // Helpers may only get to run after every iteration is done and this has returned, so they share ownership
+   struct loop_state {
+      std::function<void(std::size_t)> _func;
+      std::size_t _n;
+      std::atomic<std::size_t> _next;
+      std::size_t _finished;
+      std::mutex _mutex;
+      std::condition_variable _all_finished;
+   };
+   auto state = std::make_shared<loop_state>();
+   state->_func = func;
+   state->_n = n;
+   state->_next = 0;
+   state->_finished = 0;
+
+   const auto run_iterations = [state] {
+      std::size_t finished = 0;
+      for (std::size_t i = state->_next++; i < state->_n; i = state->_next++) {
+         state->_func(i);
+         finished++;
+      }
+      if (finished > 0) {
+         std::lock_guard<std::mutex> lock(state->_mutex);
+         state->_finished += finished;
+         if (state->_finished == state->_n) {
+            state->_all_finished.notify_all();
+         }
+      }
+   };
+
+   for (std::size_t i = 0; i < std::min(size(), n - 1); i++) {
+      submit(run_iterations);
+   }
+   run_iterations();
+
+   std::unique_lock<std::mutex> lock(state->_mutex);
+   state->_all_finished.wait(lock, [&state] { return state->_finished == state->_n; });
+}
+
+}
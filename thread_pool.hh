@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gifproc::util {
+
+// Fixed set of worker threads running queued tasks in order
+class thread_pool {
+private:
+   std::vector<std::thread> _workers;
+   std::deque<std::function<void()>> _tasks;
+   std::mutex _mutex;
+   std::condition_variable _task_ready;
+   bool _stopping;
+
+   void worker_loop();
+
+public:
+   // nthreads of 0 starts one worker per hardware thread, less one for the thread calling parallel_for
+   explicit thread_pool(std::size_t nthreads = 0);
+   ~thread_pool();
+
+   thread_pool(thread_pool const&) = delete;
+   thread_pool& operator=(thread_pool const&) = delete;
+
+   std::size_t size() const {
+      return _workers.size();
+   }
+
+   void submit(std::function<void()> task);
+
+   // Runs func(i) for every i in [0, n) and returns once they have all finished. The calling thread runs iterations
+   // as well, so this is safe to call from within a task on the same pool.
+   void parallel_for(std::size_t n, std::function<void(std::size_t)> const& func);
+};
+
+}